@@ -0,0 +1,81 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+namespace phosphor
+{
+namespace service
+{
+
+// Subsystems heap allocations are accounted to
+enum class AllocSubsystem : uint8_t
+{
+    other,
+    discovery,
+    objectServer,
+    persistence,
+    apply,
+    count
+};
+
+struct AllocStats
+{
+    uint64_t liveBytes = 0;
+    uint64_t peakBytes = 0;
+    uint64_t allocations = 0;
+    uint64_t liveAllocations = 0;
+};
+
+using AllocStatsArray =
+    std::array<AllocStats, static_cast<size_t>(AllocSubsystem::count)>;
+
+#ifdef ALLOC_ACCOUNTING
+/** @brief Account the allocations made in the lifetime of the scope to the
+ *         given subsystem. Memory is credited back to the subsystem that
+ *         allocated it, wherever it is freed.
+ */
+class AllocScope
+{
+  public:
+    explicit AllocScope(AllocSubsystem subsystem);
+    ~AllocScope();
+    AllocScope(const AllocScope&) = delete;
+    AllocScope& operator=(const AllocScope&) = delete;
+
+  private:
+    AllocSubsystem previous;
+};
+
+/** @brief Subsystem of the allocations made outside of any AllocScope */
+void setDefaultAllocSubsystem(AllocSubsystem subsystem);
+const char* allocSubsystemName(AllocSubsystem subsystem);
+AllocStatsArray getAllocStats();
+#else
+class AllocScope
+{
+  public:
+    explicit AllocScope(AllocSubsystem) {}
+};
+
+inline void setDefaultAllocSubsystem(AllocSubsystem) {}
+#endif
+
+} // namespace service
+} // namespace phosphor
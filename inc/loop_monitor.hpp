@@ -0,0 +1,65 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#pragma once
+#include "utils.hpp"
+
+#include <array>
+
+namespace phosphor
+{
+namespace service
+{
+
+static constexpr const char* loopLatencyIntfName =
+    "xyz.openbmc_project.Control.Service.Manager.LoopLatency";
+
+/** @class LoopMonitor
+ *  @brief Measures how late a periodic timer fires on the io_context, which
+ *         is how long the (single threaded) event loop was blocked. The lag
+ *         is kept as a log2 histogram and published on D-Bus. When systemd
+ *         watchdog is enabled, it is only kicked while the lag stays within
+ *         half the watchdog interval.
+ */
+class LoopMonitor
+{
+  public:
+    LoopMonitor(boost::asio::io_context& io,
+                sdbusplus::asio::object_server& server);
+
+  private:
+    // Bucket i counts lags in [2^(i-1), 2^i) us, bucket 0 counts 0 us. The
+    // last bucket also takes anything longer.
+    static constexpr size_t lagBuckets = 26;
+
+    void arm();
+    void onProbe(const boost::system::error_code& ec);
+    void record(uint64_t lagUsec);
+    uint64_t percentile(double fraction) const;
+
+    boost::asio::steady_timer probeTimer;
+    std::chrono::microseconds probeInterval;
+    std::chrono::microseconds watchdogInterval{0};
+    std::chrono::steady_clock::time_point expectedFire;
+
+    std::array<uint64_t, lagBuckets> histogram{};
+    uint64_t samples = 0;
+    uint64_t maxLagUsec = 0;
+
+    std::shared_ptr<sdbusplus::asio::dbus_interface> iface;
+};
+
+} // namespace service
+} // namespace phosphor
@@ -0,0 +1,57 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#pragma once
+#include <cstddef>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+
+namespace phosphor
+{
+namespace service
+{
+
+// Units to monitor by unit name (with the instance), as kept in the monitor
+// list file
+using MonitorListMap =
+    std::unordered_map<std::string, std::tuple<std::string, std::string,
+                                               std::string, std::string>>;
+
+enum class monitorElement
+{
+    unitName,
+    instanceName,
+    serviceObjPath,
+    socketObjPath
+};
+
+struct MonitorListChanges
+{
+    size_t added = 0;
+    size_t removed = 0;
+    size_t changed = 0;
+};
+
+/** @brief Bring the saved monitor list up to date with the units systemd
+ *         listed, in one pass over each. Units systemd listed are added or
+ *         get their object paths updated; saved units that are neither listed
+ *         nor installed anymore are removed.
+ */
+MonitorListChanges reconcileMonitorList(const MonitorListMap& listed,
+                                        MonitorListMap& saved);
+
+} // namespace service
+} // namespace phosphor
@@ -0,0 +1,96 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#pragma once
+#include <cstdint>
+#include <cstdio>
+#include <functional>
+#include <initializer_list>
+#include <optional>
+#include <span>
+#include <string>
+#include <string_view>
+
+namespace phosphor
+{
+namespace service
+{
+
+// Persisted files are text: a header line with the schema name and version,
+// then one record per line with its fields separated by tabs. Fields can't
+// hold tabs or newlines, which unit names, object paths and the values we
+// keep never do.
+static constexpr size_t persistMaxFields = 8;
+static constexpr size_t persistMaxLineLength = 1024;
+
+// Fields of one record. The views point into the reader's line buffer, and
+// are only valid during the callback.
+using PersistRecord = std::span<const std::string_view>;
+
+enum class PersistReadResult : uint8_t
+{
+    ok,
+    missing,
+    // Not this schema and version, possibly a file of an earlier version
+    otherFormat,
+    corrupt
+};
+
+/** @brief Read the records of a persisted file, without allocating */
+PersistReadResult readPersistFile(
+    const std::string& path, std::string_view schema, uint32_t version,
+    const std::function<void(PersistRecord)>& callback);
+
+/** @brief Write a persisted file. Records go to a temporary file that only
+ *         replaces the file on commit(), so a failed write never leaves a
+ *         partial file behind.
+ */
+class PersistWriter
+{
+  public:
+    PersistWriter(const std::string& path, std::string_view schema,
+                  uint32_t version);
+    ~PersistWriter();
+    PersistWriter(const PersistWriter&) = delete;
+    PersistWriter& operator=(const PersistWriter&) = delete;
+
+    void record(std::initializer_list<std::string_view> fields);
+    /** @brief Replace the file with the records written, return whether it
+     *         succeeded
+     */
+    bool commit();
+
+  private:
+    std::string path;
+    std::string tmpPath;
+    std::FILE* file = nullptr;
+};
+
+std::string_view persistBool(bool value);
+std::optional<bool> parsePersistBool(std::string_view value);
+
+/** @brief Walk the scalar members of a JSON file written by an earlier
+ *         version, in document order, with the name of the member they are
+ *         in. Nesting is flattened and strings are passed without quotes.
+ *         Only meant to migrate those files: escaped strings are not
+ *         supported, and fail the walk like malformed files do.
+ */
+bool forEachLegacyJsonValue(
+    const std::string& path,
+    const std::function<void(std::string_view name, std::string_view value)>&
+        callback);
+
+} // namespace service
+} // namespace phosphor
@@ -0,0 +1,65 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#pragma once
+#include "srvcfg_manager.hpp"
+
+namespace phosphor
+{
+namespace service
+{
+
+// Per object results returned by SetServices()
+static constexpr const char* bulkResultStaged = "Staged";
+static constexpr const char* bulkResultUnchanged = "Unchanged";
+static constexpr const char* bulkResultAborted = "Aborted";
+
+// Sent on the manager interface at the end of every apply cycle, with the
+// outcome of the cycle and the objects it applied
+static constexpr const char* applyCompletedSignal = "ApplyCompleted";
+
+using ServicesMap = std::map<sdbusplus::object_path, ServicePropertyMap>;
+using ServicesResultMap = std::map<sdbusplus::object_path, std::string>;
+// Plan() reply: systemd calls as (method, units, estimated ms), drop-ins as
+// (path, contents), whether systemd is reloaded, and the estimated total ms
+using PlanCalls =
+    std::vector<std::tuple<std::string, std::vector<std::string>, uint64_t>>;
+using PlanDropIns = std::vector<std::tuple<std::string, std::string>>;
+using PlanResult = std::tuple<PlanCalls, PlanDropIns, bool, uint64_t>;
+// GetApplyHistory() entry: start (us since the epoch), outcome, stop, reload
+// and restart phase durations in ms, objects as (path, changed properties,
+// units, outcome, rolled back), and systemd calls as (method, units, ms,
+// result)
+using HistoryObjects = std::vector<std::tuple<
+    std::string, std::vector<std::string>, std::vector<std::string>,
+    std::string, bool>>;
+using HistoryCalls =
+    std::vector<std::tuple<std::string, std::string, uint64_t, std::string>>;
+using HistoryEntry = std::tuple<uint64_t, std::string, uint64_t, uint64_t,
+                                uint64_t, HistoryObjects, HistoryCalls>;
+// GetAllocationStats() reply: subsystem to (live bytes, peak bytes,
+// allocations, live allocations)
+using AllocationStatsMap =
+    std::map<std::string, std::tuple<uint64_t, uint64_t, uint64_t, uint64_t>>;
+
+/** @brief Register the manager interface, which reads and writes the
+ *         properties of all managed services in one D-Bus call.
+ */
+std::shared_ptr<sdbusplus::asio::dbus_interface> registerBulkInterface(
+    sdbusplus::asio::object_server& server,
+    const std::shared_ptr<sdbusplus::asio::connection>& conn);
+
+} // namespace service
+} // namespace phosphor
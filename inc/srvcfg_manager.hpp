@@ -14,11 +14,15 @@
 // limitations under the License.
 */
 #pragma once
+#include "unit_registry.hpp"
 #include "utils.hpp"
 
-#include <boost/container/flat_map.hpp>
 #include <sdbusplus/timer.hpp>
 
+#include <array>
+#include <map>
+#include <optional>
+
 namespace phosphor
 {
 namespace service
@@ -26,6 +30,8 @@ namespace service
 
 static constexpr const char* serviceConfigSrvName =
     "xyz.openbmc_project.Control.Service.Manager";
+static constexpr const char* serviceConfigMgrIntfName =
+    "xyz.openbmc_project.Control.Service.Manager";
 static constexpr const char* serviceConfigIntfName =
     "xyz.openbmc_project.Control.Service.Attributes";
 static constexpr const char* sockAttrIntfName =
@@ -36,9 +42,31 @@ static constexpr const char* sockAttrPropPort = "Port";
 static constexpr const char* srvCfgPropMasked = "Masked";
 static constexpr const char* srvCfgPropEnabled = "Enabled";
 static constexpr const char* srvCfgPropRunning = "Running";
+static constexpr const char* applyStatusIntfName =
+    "xyz.openbmc_project.Control.Service.ApplyStatus";
+static constexpr const char* applyStatusPropPending = "PendingChanges";
+static constexpr const char* applyStatusPropState = "ApplyState";
+static constexpr const char* applyStatusPropResult = "LastApplyResult";
+static constexpr const char* applyResultRolledBack = "RolledBack";
+static constexpr const char* systemdOverrideUnitBasePath =
+    "/etc/systemd/system/";
+static constexpr const char* applyStatusPropStopTimes = "StopTimes";
+static constexpr const char* applyStatusPropStartTimes = "StartTimes";
 
 #ifdef USB_CODE_UPDATE
 static constexpr const char* usbCodeUpdateUnitName = "phosphor_usb_code_update";
+static constexpr const char* usbCodeUpdateServiceObjPath =
+    "/org/freedesktop/systemd1/unit/usb_2dcode_2dupdate_2eservice";
+
+// State of the USB code update pseudo unit. It isn't a systemd unit: the state
+// is kept in a state file and applied through a udev rules file.
+struct UsbCodeUpdateState
+{
+    bool masked = false;
+    bool enabled = true;
+
+    bool operator==(const UsbCodeUpdateState&) const = default;
+};
 #endif
 
 enum class UpdatedProp
@@ -49,10 +77,142 @@ enum class UpdatedProp
     runningState
 };
 
-using VariantType =
-    std::variant<std::string, int64_t, uint64_t, double, int32_t, uint32_t,
-                 int16_t, uint16_t, uint8_t, bool,
-                 std::vector<std::tuple<std::string, std::string>>>;
+// Property name to value map, as accepted by SetServices() and returned by
+// GetServices() on the manager interface
+using ServicePropertyMap =
+    std::map<std::string, std::variant<bool, uint16_t>>;
+
+// Ports requested by the entries of a batch checked so far, by port index
+// key, to the object path requesting them
+using BatchPortClaims = std::map<uint32_t, std::string>;
+
+// A systemd call of an apply cycle, the units it acts on, and how long it is
+// expected to take
+struct PlannedCall
+{
+    std::string method;
+    std::vector<std::string> units;
+    std::chrono::milliseconds estimate{0};
+};
+
+struct PlannedDropIn
+{
+    std::string path;
+    std::string contents;
+};
+
+// The work of an apply cycle for one object. Both the apply cycle and Plan()
+// run from this, so that what is planned is what gets done.
+struct UnitApplyPlan
+{
+    // Whether the object takes part in the cycle at all
+    bool pending = false;
+    std::vector<std::string> stopUnits;
+    // Running instances of a socket activated service to stop, as a
+    // <unit>@*.service pattern resolved at apply time; empty when none
+    std::string stopInstances;
+    std::optional<PlannedDropIn> dropIn;
+    std::vector<std::string> unitFiles;
+    std::vector<UnitFilesMethod> unitFilesMethods;
+    std::vector<std::string> restartUnits;
+    // Port the socket keeps listening on next to the new one while moving to
+    // it, to be dropped by a later cycle; 0 when none
+    uint16_t retirePort = 0;
+};
+
+// The work of a whole apply cycle, in execution order
+struct ApplyPlan
+{
+    std::vector<PlannedCall> calls;
+    std::vector<PlannedDropIn> dropIns;
+    bool daemonReload = false;
+    std::chrono::milliseconds estimate{0};
+};
+
+// Client write admission counters, published on the manager interface
+struct WriteStatistics
+{
+    // Writes rejected by the rate limits
+    uint64_t throttled = 0;
+    // Writes of the value already staged, accepted without a new apply
+    uint64_t coalesced = 0;
+};
+
+// Where the staged changes of an object are, published as ApplyState
+enum class ApplyState : uint8_t
+{
+    idle,
+    staged,
+    applying,
+    failed
+};
+
+enum class ApplyOutcome : uint8_t
+{
+    success,
+    failed,
+    timedOut
+};
+
+// One object of an apply cycle, see ApplyRecord
+struct ApplyObjectRecord
+{
+    std::string objPath;
+    // UpdatedProp bits staged for the cycle
+    uint8_t updatedFlag = 0;
+    std::vector<std::string> units;
+    ApplyOutcome outcome = ApplyOutcome::success;
+    // Whether a failure was rolled back to the state before the cycle
+    bool rolledBack = false;
+};
+
+// A past apply cycle, as kept in the apply history
+struct ApplyRecord
+{
+    // Wall clock start of the cycle
+    std::chrono::system_clock::time_point start;
+    std::vector<ApplyObjectRecord> objects;
+    // Phases: stop and apply, daemon-reload, restart
+    std::chrono::milliseconds stopDuration{0};
+    std::chrono::milliseconds reloadDuration{0};
+    std::chrono::milliseconds restartDuration{0};
+    std::vector<SystemdCallResult> calls;
+    ApplyOutcome outcome = ApplyOutcome::success;
+};
+
+// Stop or start time of an object in one apply cycle
+struct UnitJobTimes
+{
+    // Wall clock enqueue time of the first job, us since the epoch
+    uint64_t start = 0;
+    // Our jobs, from enqueue to completion
+    std::chrono::milliseconds job{0};
+    // systemd's own stop (ActiveExit to InactiveEnter) or start (InactiveExit
+    // to ActiveEnter) time of the units, excluding job queueing
+    std::chrono::milliseconds unit{0};
+};
+
+// Recent UnitJobTimes of an object as published, oldest first: start (us),
+// job (ms), unit (ms)
+using UnitJobTimesHistory =
+    std::vector<std::tuple<uint64_t, uint64_t, uint64_t>>;
+
+struct UnitPropertyFetch;
+
+// What an apply cycle is about to change on a unit, taken before the change so
+// that a failed apply can be rolled back
+struct ApplySnapshot
+{
+    bool restoreDropIn = false;
+    // Previous drop-in contents, none if there was no drop-in
+    std::optional<std::string> dropIn;
+    // Unit files to put back to unitFileState, none if untouched
+    std::vector<std::string> unitFiles;
+    UnitFileState unitFileState = UnitFileState::other;
+    // Units to restart if the unit was running, or else to stop
+    std::vector<std::string> units;
+    bool running = false;
+};
 
 class ServiceConfig
 {
@@ -60,71 +220,204 @@ class ServiceConfig
     ServiceConfig(sdbusplus::asio::object_server& srv_,
                   std::shared_ptr<sdbusplus::asio::connection>& conn_,
                   const std::string& objPath_, const std::string& baseUnitName,
-                  const std::string& instanceName,
-                  const std::string& serviceObjPath,
-                  const std::string& socketObjPath);
-    ~ServiceConfig() = default;
+                  const std::string& instanceName, bool hasServiceUnit,
+                  bool hasSocketUnit);
+    ~ServiceConfig();
 
+    // Connection for systemd calls, not the one the object server is on
     std::shared_ptr<sdbusplus::asio::connection> conn;
     uint8_t updatedFlag;
+    // Set when added to the registry, for async callbacks to find the object
+    UnitHandle handle;
 
-    void stopAndApplyUnitConfig(boost::asio::yield_context yield);
-    void restartUnitConfig(boost::asio::yield_context yield);
+    boost::asio::awaitable<void> stopAndApplyUnitConfig();
+    boost::asio::awaitable<void> restartUnitConfig();
+    void takeApplySnapshot();
+    // Rollback of a failed apply, in two steps so that the daemon-reload in
+    // between is shared by all the objects rolled back
+    boost::asio::awaitable<void> restoreUnitConfig();
+    boost::asio::awaitable<void> restartRestoredUnits();
+    void markDirty();
+    void setApplyState(ApplyState state);
+    // Whether the object is part of the running apply cycle
+    bool isApplying() const
+    {
+        return applyState == ApplyState::applying;
+    }
+    void finishApply(const ApplyObjectRecord& record);
     void startServiceRestartTimer();
     void reloadServiceConfig();
+    void reportApplyFailure(const std::exception& e, bool timedOut);
+    void discardStagedChanges();
+    UnitApplyPlan planApply(const ServicePropertyMap& changes = {});
+    ApplyObjectRecord startApplyRecord();
+
+    /** @brief Names of the unit files of the object, as found in
+     *         systemdOverrideUnitBasePath when masked or enabled
+     */
+    std::vector<std::string> getUnitFileNames() const;
+    std::string getOverrideConfDir() const;
+    std::string getInstantiatedUnitName() const;
+    std::string getServiceObjectPath() const;
+    std::string getSocketObjectPath() const;
+
+    ServicePropertyMap getProperties() const;
+    /** @brief Check changes before staging them. With `batchPorts`, the
+     *         port is also checked against, and added to, the ports
+     *         requested by the other entries of the same batch.
+     */
+    std::string checkPropertyChanges(
+        const ServicePropertyMap& changes,
+        BatchPortClaims* batchPorts = nullptr) const;
+    /** @brief Whether staging checked changes would change anything */
+    bool hasPropertyChanges(const ServicePropertyMap& changes) const;
+    bool stagePropertyChanges(const ServicePropertyMap& changes);
+
+    /** @brief Read back the systemd state of the given objects with one
+     *         ListUnitsByNames call and a single pipelined batch of property
+     *         reads, and update them all once every reply is in. `done`
+     *         is called once they are updated, or failed to.
+     */
+    static void refreshProperties(
+        const std::shared_ptr<sdbusplus::asio::connection>& conn,
+        std::vector<std::shared_ptr<ServiceConfig>> objects,
+        std::function<void()> done = {});
+    static boost::asio::awaitable<void> awaitRefreshProperties(
+        const std::shared_ptr<sdbusplus::asio::connection>& conn,
+        std::vector<std::shared_ptr<ServiceConfig>> objects);
 
 #ifdef USB_CODE_UPDATE
     void saveUSBCodeUpdateStateToFile(const bool& maskedState,
                                       const bool& enabledState);
     void getUSBCodeUpdateStateFromFile();
     void setUSBCodeUpdateState(const bool& state);
+    void queueUSBCodeUpdateWrite();
+    void writeUSBCodeUpdateState();
 #endif
 
   private:
     sdbusplus::asio::object_server& server;
     std::shared_ptr<sdbusplus::asio::dbus_interface> srvCfgIface;
     std::shared_ptr<sdbusplus::asio::dbus_interface> sockAttrIface;
+    std::shared_ptr<sdbusplus::asio::dbus_interface> applyStatusIface;
+    TokenBucket writeLimiter;
+    std::optional<ApplySnapshot> applySnapshot;
 
-    bool internalSet = false;
+    // Strings are limited to what can't be derived, as there can be hundreds
+    // of instances. Unit names and paths are built on demand from the
+    // interned base unit name and the instance name.
     std::string objPath;
-    std::string baseUnitName;
+    std::string_view baseUnitName;
     std::string instanceName;
-    std::string instantiatedUnitName;
-    std::string serviceObjectPath;
-    std::string socketObjectPath;
-    std::string overrideConfDir;
 
     // Properties
-    std::string activeState;
-    std::string subState;
-    uint16_t portNum;
-    std::vector<std::string> channelList;
-    std::string protocol;
-    std::string stateValue;
+    uint16_t portNum = 0;
+    // Port the socket listens on, as opposed to the staged portNum
+    uint16_t listenPort = 0;
+    // Previous port the socket still listens on while moving to listenPort
+    uint16_t retiringPort = 0;
+    std::unique_ptr<boost::asio::steady_timer> portRetireTimer;
+    // Entries held in the port index, see claimPorts()
+    std::array<uint32_t, 3> portClaims{};
+    UnitFileState unitFileState = UnitFileState::other;
+    UnitSubState unitSubState = UnitSubState::other;
+    SocketProtocol protocol = SocketProtocol::stream;
     bool unitMaskedState = false;
     bool unitEnabledState = false;
     bool unitRunningState = false;
 
-    bool isSocketActivatedService = false;
-    std::string subStateValue;
+    ApplyState applyState = ApplyState::idle;
+    std::string lastApplyResult;
+    // Times of the apply cycle in progress, and of the past ones
+    std::optional<UnitJobTimes> cycleStopTimes;
+    std::optional<UnitJobTimes> cycleStartTimes;
+    UnitJobTimesHistory stopTimes;
+    UnitJobTimesHistory startTimes;
+
+#ifdef USB_CODE_UPDATE
+    // Current state, only read from the state file at startup
+    std::optional<UsbCodeUpdateState> usbCodeUpdateState;
+    // What the state file and the udev rules were last written with
+    std::optional<UsbCodeUpdateState> usbCodeUpdateWritten;
+    std::optional<bool> usbCodeUpdateRulesWritten;
+    std::unique_ptr<boost::asio::steady_timer> usbCodeUpdateTimer;
+    bool usbCodeUpdateWriteQueued = false;
+#endif
 
-    std::string stateFile;
+    bool internalSet = false;
+    // Whether startup still waits for the first property query
+    bool startupPending = true;
+    bool hasServiceUnit = false;
+    bool hasSocketUnit = false;
+    bool isSocketActivatedService = false;
 
     bool isMaskedOut();
+    bool stageChanges(const ServicePropertyMap& changes);
+    std::string getSocketOverrideConf(uint16_t extraPort = 0) const;
+    bool canMigratePort() const;
+    void schedulePortRetirement();
+    void resumePortRetirement();
+    void writeSocketOverrideConf(const PlannedDropIn& dropIn);
+    boost::asio::awaitable<void> timedUnitAction(const std::string& unit,
+                                                 const char* action);
+    void publishUnitJobTimes();
+    void admitWrite();
+    void stageMaskedState(bool state);
+    void stageEnabledState(bool state);
+    void stageRunningState(bool state);
+    void stagePort(uint16_t port);
+    void claimPorts();
+    std::string checkPortConflict(uint16_t port) const;
+    void publishProperties();
     void registerProperties();
     void queryAndUpdateProperties(bool isRestore);
+    void reportStartupPublished();
+    template <typename Handler>
+    void fetchUnitFileStateAndListen(
+        const std::shared_ptr<UnitPropertyFetch>& fetch,
+        const Handler& handler);
+    void applyFetchedProperties(const UnitPropertyFetch& fetch,
+                                bool isRestore);
     void createSocketOverrideConf();
-    void updateServiceProperties(
-        const boost::container::flat_map<std::string, VariantType>&
-            propertyMap);
-    void updateSocketProperties(
-        const boost::container::flat_map<std::string, VariantType>&
-            propertyMap);
-    std::string getSocketUnitName();
-    std::string getServiceUnitName();
+    void updateServiceProperties(UnitFileState fileState,
+                                 UnitSubState subState);
+    void updateSocketProperties(const ListenAddress& listen);
+    std::string getSocketUnitName() const;
+    std::string getServiceUnitName() const;
+    std::string getStateObjectPath() const;
+    std::string getStateUnitName() const;
+    std::string getStateFile() const;
     void writeStateFile();
     void loadStateFile();
 };
 
+bool isUpdateInProgress();
+
+/** @brief Run the callback once no apply cycle is running, right away if
+ *         none is
+ */
+void runAfterApplyCycle(std::function<void()> callback);
+void setDryRun(bool enabled);
+
+/** @brief Plan the apply cycle for the staged changes, with `changes` (keyed
+ *         by object path) staged on top of them. Nothing is modified.
+ */
+ApplyPlan buildApplyPlan(
+    const std::map<std::string, ServicePropertyMap>& changes = {});
+void admitBulkWrite();
+const WriteStatistics& getWriteStatistics();
+const char* applyOutcomeName(ApplyOutcome outcome);
+const char* applyStateName(ApplyState state);
+
+/** @brief Call `handler` at the end of every apply cycle */
+void setApplyCompletedHandler(std::function<void(const ApplyRecord&)> handler);
+std::vector<std::string> updatedPropNames(uint8_t updatedFlag);
+
+/** @brief Recent apply cycles, oldest first */
+std::vector<const ApplyRecord*> getApplyHistory();
+void scheduleServiceApply(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    std::chrono::seconds delay);
+
 } // namespace service
 } // namespace phosphor
@@ -0,0 +1,73 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#pragma once
+#include "utils.hpp"
+
+namespace phosphor
+{
+namespace service
+{
+
+static constexpr const char* startupIntfName =
+    "xyz.openbmc_project.Control.Service.Manager.Startup";
+
+// Startup phases, in order. Phases that run per object (state files and
+// interface registration) add up the time spent on all objects.
+enum class StartupPhase : uint8_t
+{
+    busConnect,
+    listUnits,
+    unitProperties,
+    stateFiles,
+    registration,
+    count
+};
+
+void startStartupPhase(StartupPhase phase);
+void endStartupPhase(StartupPhase phase);
+
+/** @brief Add the lifetime of the scope to a per object startup phase. Only
+ *         counts until startup completes.
+ */
+class StartupPhaseTimer
+{
+  public:
+    explicit StartupPhaseTimer(StartupPhase phase);
+    ~StartupPhaseTimer();
+    StartupPhaseTimer(const StartupPhaseTimer&) = delete;
+    StartupPhaseTimer& operator=(const StartupPhaseTimer&) = delete;
+
+  private:
+    StartupPhase phase;
+    std::chrono::steady_clock::time_point start;
+};
+
+/** @brief Publish the startup phases on the manager object */
+void registerStartupInterface(sdbusplus::asio::object_server& server);
+
+/** @brief Startup waits for `count` objects to publish their properties.
+ *         Startup completes when the last one reports in.
+ */
+void expectStartupObjects(size_t count);
+void startupObjectPublished();
+
+/** @brief Tell systemd we are ready although startup can't complete, with
+ *         the failure as status
+ */
+void notifyReadyEarly(const std::string& status);
+
+} // namespace service
+} // namespace phosphor
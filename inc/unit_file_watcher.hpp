@@ -0,0 +1,80 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#pragma once
+#include "srvcfg_manager.hpp"
+
+#include <boost/asio/posix/stream_descriptor.hpp>
+#include <sdbusplus/bus/match.hpp>
+
+#include <set>
+#include <unordered_map>
+
+struct inotify_event;
+
+namespace phosphor
+{
+namespace service
+{
+
+/** @class UnitFileWatcher
+ *  @brief Watches the unit file directories and the socket drop-in
+ *         directories of the managed objects with inotify. A change made by
+ *         anyone but us refreshes the object it belongs to, once the changes
+ *         settle, and again once systemd reloads, which is when systemd takes
+ *         it into account.
+ */
+class UnitFileWatcher
+{
+  public:
+    UnitFileWatcher(boost::asio::io_context& io,
+                    std::shared_ptr<sdbusplus::asio::connection> conn,
+                    const UnitRegistry& registry);
+
+    void addObject(const std::shared_ptr<ServiceConfig>& object);
+
+  private:
+    using ObjectSet =
+        std::set<std::weak_ptr<ServiceConfig>, std::owner_less<>>;
+
+    void addUnitDirWatch(const std::string& dir);
+    void addDropInWatch(const std::weak_ptr<ServiceConfig>& object);
+    void readEvents();
+    void handleEvent(const inotify_event& event);
+    void markChanged(const std::weak_ptr<ServiceConfig>& object);
+    void scheduleRefresh();
+    void refresh();
+
+    std::shared_ptr<sdbusplus::asio::connection> conn;
+    // Finds the object a unit file or drop-in directory belongs to
+    const UnitRegistry& registry;
+    boost::asio::posix::stream_descriptor inotifyStream;
+    boost::asio::steady_timer debounceTimer;
+    std::unique_ptr<sdbusplus::bus::match_t> reloadMatch;
+    alignas(uint32_t) std::array<char, 4096> eventBuffer{};
+
+    // Directories holding unit file links: systemdOverrideUnitBasePath and
+    // its .wants and .requires directories
+    std::unordered_map<int, std::string> unitDirWatches;
+    std::unordered_map<int, std::weak_ptr<ServiceConfig>> dropInWatches;
+
+    // Objects waiting for the changes to settle, and to be refreshed again
+    // at the next systemd reload
+    ObjectSet changed;
+    ObjectSet awaitingReload;
+};
+
+} // namespace service
+} // namespace phosphor
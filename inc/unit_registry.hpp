@@ -0,0 +1,122 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+namespace phosphor
+{
+namespace service
+{
+
+class ServiceConfig;
+
+// Reference to a registered object for async callbacks to hold instead of a
+// raw pointer. It only resolves to the object it was handed out for, so a
+// callback outliving its object finds nothing rather than a dangling one.
+struct UnitHandle
+{
+    uint32_t slot = 0;
+    // Zero for no registration
+    uint32_t generation = 0;
+};
+
+/** @class UnitRegistry
+ *  @brief The managed objects, by D-Bus object path in path order, with
+ *         constant time lookups by unit name for routing file events to
+ *         their object.
+ */
+class UnitRegistry
+{
+  public:
+    using ObjectMap = std::map<std::string, std::shared_ptr<ServiceConfig>>;
+
+    /** @brief Register an object under its D-Bus object path. Returns an
+     *         empty handle if the path is taken.
+     */
+    UnitHandle add(const std::string& objPath,
+                   std::shared_ptr<ServiceConfig> object);
+
+    std::shared_ptr<ServiceConfig> get(UnitHandle handle) const;
+    /** @brief Find by instantiated unit name, with or without its .service or
+     *         .socket suffix
+     */
+    std::shared_ptr<ServiceConfig> findByUnitName(
+        std::string_view unitName) const;
+
+    ObjectMap::iterator find(const std::string& objPath)
+    {
+        return objects.find(objPath);
+    }
+    ObjectMap::iterator begin()
+    {
+        return objects.begin();
+    }
+    ObjectMap::iterator end()
+    {
+        return objects.end();
+    }
+    ObjectMap::const_iterator begin() const
+    {
+        return objects.begin();
+    }
+    ObjectMap::const_iterator end() const
+    {
+        return objects.end();
+    }
+    const std::shared_ptr<ServiceConfig>& at(const std::string& objPath) const
+    {
+        return objects.at(objPath);
+    }
+    size_t size() const
+    {
+        return objects.size();
+    }
+
+  private:
+    struct StringHash
+    {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view str) const
+        {
+            return std::hash<std::string_view>{}(str);
+        }
+    };
+    using Index =
+        std::unordered_map<std::string, uint32_t, StringHash, std::equal_to<>>;
+
+    struct Slot
+    {
+        std::shared_ptr<ServiceConfig> object;
+        uint32_t generation = 1;
+    };
+
+    std::vector<std::string> unitKeys(const ServiceConfig& object) const;
+
+    ObjectMap objects;
+    std::vector<Slot> slots;
+    Index byUnitName;
+};
+
+} // namespace service
+} // namespace phosphor
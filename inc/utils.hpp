@@ -15,29 +15,40 @@
 */
 #pragma once
 #include <boost/asio.hpp>
+#include <boost/asio/awaitable.hpp>
 #include <phosphor-logging/elog-errors.hpp>
 #include <phosphor-logging/lg2.hpp>
 #include <sdbusplus/asio/object_server.hpp>
 #include <xyz/openbmc_project/Common/error.hpp>
 
+#include <algorithm>
 #include <chrono>
 #include <ctime>
+#include <deque>
 #include <filesystem>
+#include <functional>
+#include <optional>
 #include <string>
+#include <string_view>
+#include <vector>
 
 static constexpr const char* sysdStartUnit = "StartUnit";
 static constexpr const char* sysdStopUnit = "StopUnit";
 static constexpr const char* sysdRestartUnit = "RestartUnit";
 static constexpr const char* sysdReloadMethod = "Reload";
 static constexpr const char* sysdGetJobMethod = "GetJob";
+static constexpr const char* sysdCancelMethod = "Cancel";
 static constexpr const char* sysdReplaceMode = "replace";
 static constexpr const char* dBusGetAllMethod = "GetAll";
 static constexpr const char* dBusGetMethod = "Get";
 static constexpr const char* sysdService = "org.freedesktop.systemd1";
 static constexpr const char* sysdObjPath = "/org/freedesktop/systemd1";
+static constexpr const char* sysdUnitBasePath =
+    "/org/freedesktop/systemd1/unit";
 static constexpr const char* sysdMgrIntf = "org.freedesktop.systemd1.Manager";
 static constexpr const char* sysdUnitIntf = "org.freedesktop.systemd1.Unit";
 static constexpr const char* sysdSocketIntf = "org.freedesktop.systemd1.Socket";
+static constexpr const char* sysdJobIntf = "org.freedesktop.systemd1.Job";
 static constexpr const char* dBusPropIntf = "org.freedesktop.DBus.Properties";
 static constexpr const char* stateMasked = "masked";
 static constexpr const char* stateEnabled = "enabled";
@@ -48,23 +59,129 @@ static constexpr const char* loadStateNotFound = "not-found";
 static constexpr const char* srvDataBaseDir =
     "/var/lib/service-config-manager/";
 
-using ListUnitsType =
-    std::tuple<std::string, std::string, std::string, std::string, std::string,
-               std::string, sdbusplus::object_path, uint32_t, std::string,
-               sdbusplus::object_path>;
+// Time allowed for each systemd operation of an apply cycle: a unit job
+// (including waiting for it to finish), a daemon-reload, or a unit file
+// state change. A unit job still running at the deadline is cancelled.
+static constexpr const auto systemdJobTimeout =
+    std::chrono::seconds(SYSTEMD_JOB_TIMEOUT);
 
-enum class ListUnitElements
+// One entry of a ListUnits reply, limited to the fields we use. The views
+// point into the reply message.
+struct ListedUnit
 {
-    name,
-    descriptionString,
-    loadState,
-    activeState,
-    subState,
-    followedUnit,
-    objectPath,
-    queuedJobType,
-    jobType,
-    jobObject
+    std::string_view name;
+    std::string_view loadState;
+    std::string_view subState;
+    std::string_view objectPath;
+};
+
+// Compact forms of the systemd unit states we act on. Any other value of the
+// systemd property is mapped to `other`.
+enum class UnitFileState : uint8_t
+{
+    enabled,
+    disabled,
+    masked,
+    other
+};
+
+enum class UnitSubState : uint8_t
+{
+    running,
+    listening,
+    other
+};
+
+// Listen types of the socket units we manage, used as the suffix of the
+// Listen<type>= directive
+enum class SocketProtocol : uint8_t
+{
+    stream,
+    datagram,
+    sequentialPacket
+};
+
+// First Listen entry of a socket unit, reduced to what we manage
+struct ListenAddress
+{
+    SocketProtocol protocol;
+    uint16_t port;
+};
+
+// Unit file state changes, in the order they are made
+enum class UnitFilesMethod : uint8_t
+{
+    unmask,
+    mask,
+    enable,
+    disable
+};
+
+UnitFileState toUnitFileState(std::string_view state);
+UnitSubState toUnitSubState(std::string_view subState);
+std::optional<SocketProtocol> toSocketProtocol(std::string_view protocol);
+const char* socketProtocolName(SocketProtocol protocol);
+const char* unitFilesMethodName(UnitFilesMethod method);
+
+/** @brief Decode the value of a string Properties.Get reply in place. The
+ *         view is only valid as long as the message.
+ */
+std::string_view readStringProperty(sdbusplus::message_t& msg);
+
+/** @brief Decode the first entry of a socket Listen Properties.Get reply,
+ *         without copying the rest of the list out of the message.
+ */
+std::optional<ListenAddress> readListenProperty(sdbusplus::message_t& msg);
+
+/** @brief Walk a ListUnits reply in place, calling back for each unit. Units
+ *         are never copied out of the message, so callers only pay for the
+ *         entries they keep.
+ */
+void forEachListedUnit(sdbusplus::message_t& msg,
+                       const std::function<void(const ListedUnit&)>& callback);
+
+/** @brief Check whether anything on the system listens on the given port.
+ *         Sequential packet sockets are not checked, and are reported free.
+ */
+bool isPortListening(SocketProtocol protocol, uint16_t port);
+
+/** @brief Return a view of a single shared copy of the given string. The view
+ *         stays valid for the lifetime of the process.
+ */
+std::string_view internString(std::string_view str);
+
+/** @brief Return the systemd D-Bus object path of the given unit */
+std::string systemdUnitObjectPath(const std::string& unitName);
+
+// Token bucket rate limiter: up to `capacity` events at once, refilled at
+// `ratePerSec`
+class TokenBucket
+{
+  public:
+    TokenBucket(double capacity, double ratePerSec) :
+        capacity(capacity), ratePerSec(ratePerSec), tokens(capacity),
+        lastRefill(std::chrono::steady_clock::now())
+    {}
+
+    bool available()
+    {
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> elapsed = now - lastRefill;
+        lastRefill = now;
+        tokens = std::min(capacity, tokens + elapsed.count() * ratePerSec);
+        return tokens >= 1;
+    }
+
+    void consume()
+    {
+        tokens -= 1;
+    }
+
+  private:
+    double capacity;
+    double ratePerSec;
+    double tokens;
+    std::chrono::steady_clock::time_point lastRefill;
 };
 
 static inline std::string addInstanceName(const std::string& instanceName,
@@ -76,16 +193,110 @@ static inline std::string addInstanceName(const std::string& instanceName,
 void checkAndThrowInternalFailure(boost::system::error_code& ec,
                                   const std::string& msg);
 
-void systemdDaemonReload(
+/** @brief Like checkAndThrowInternalFailure, but throws Common.Error.Timeout
+ *         when the systemd operation ran out of time.
+ */
+void checkAndThrowSystemdFailure(boost::system::error_code& ec,
+                                 const std::string& msg);
+
+boost::asio::awaitable<void> systemdDaemonReload(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn);
+
+// Results of finished systemd jobs, by job object path, until the caller
+// waiting on the job takes them. Only the latest `maxEntries` are kept, as
+// jobs of other clients are recorded too.
+class JobResults
+{
+  public:
+    explicit JobResults(size_t maxEntries) : maxEntries(maxEntries) {}
+
+    void record(std::string jobPath, std::string result);
+    std::optional<std::string> take(std::string_view jobPath);
+
+  private:
+    size_t maxEntries;
+    std::deque<std::pair<std::string, std::string>> results;
+};
+
+/** @brief Throw when a systemd job result (as in JobRemoved) is anything but
+ *         done or skipped: Common.Error.Timeout for a timeout, or else
+ *         InternalFailure.
+ */
+void checkJobResult(std::string_view result, const std::string& msg);
+
+/** @brief Subscribe to systemd signals on the connection, once. systemd only
+ *         sends its signals to subscribers.
+ */
+void subscribeSystemdSignals(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn);
+
+/** @brief Record the result of every systemd job, so that unit actions can
+ *         tell a failed job from a successful one. Needed on the connection
+ *         of systemdUnitAction() before any unit action.
+ */
+void watchJobResults(const std::shared_ptr<sdbusplus::asio::connection>& conn);
+
+boost::asio::awaitable<void> systemdUnitAction(
     const std::shared_ptr<sdbusplus::asio::connection>& conn,
-    boost::asio::yield_context yield);
+    const std::string& unitName, const std::string& actionMethod);
 
-void systemdUnitAction(const std::shared_ptr<sdbusplus::asio::connection>& conn,
-                       boost::asio::yield_context yield,
-                       const std::string& unitName,
-                       const std::string& actionMethod);
+// State transition timestamps of a unit, in microseconds of CLOCK_REALTIME.
+// Zero when the unit never made the transition.
+struct UnitTransitionTimes
+{
+    uint64_t activeExit = 0;
+    uint64_t inactiveEnter = 0;
+    uint64_t inactiveExit = 0;
+    uint64_t activeEnter = 0;
+};
+
+/** @brief Read the last state transition timestamps of a unit. Failures are
+ *         logged and read as zero, as these are only informational.
+ */
+boost::asio::awaitable<UnitTransitionTimes> getUnitTransitionTimes(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    const std::string& unitName);
 
-void systemdUnitFilesStateChange(
+/** @brief Return the unit file calls that move unit files from unitState to
+ *         the requested masked and enabled state.
+ */
+std::vector<UnitFilesMethod> getUnitFilesStateChanges(
+    UnitFileState unitState, bool maskedState, bool enabledState);
+
+boost::asio::awaitable<void> systemdUnitFilesStateChange(
     const std::shared_ptr<sdbusplus::asio::connection>& conn,
-    boost::asio::yield_context yield, const std::vector<std::string>& unitFiles,
-    const std::string& unitState, bool maskedState, bool enabledState);
+    const std::vector<std::string>& unitFiles,
+    const std::vector<UnitFilesMethod>& methods);
+
+std::string joinUnitNames(const std::vector<std::string>& units);
+
+// systemd call results, named after the systemd job results
+static constexpr const char* systemdResultDone = "done";
+static constexpr const char* systemdResultTimeout = "timeout";
+static constexpr const char* systemdResultFailed = "failed";
+
+struct SystemdCallResult
+{
+    std::string method;
+    // Space separated units the call acted on, if any
+    std::string units;
+    std::chrono::milliseconds duration{0};
+    const char* result = systemdResultDone;
+};
+
+/** @brief Append the result of every systemd call made from now on to `log`,
+ *         up to `maxEntries`. Pass null to stop.
+ */
+void setSystemdCallLog(std::vector<SystemdCallResult>* log, size_t maxEntries);
+
+/** @brief Record how long a systemd call took to complete. units is the
+ *         space separated list of units it acted on, if any.
+ */
+void recordSystemdDuration(const std::string& method, const std::string& units,
+                           std::chrono::milliseconds duration);
+
+/** @brief Expected duration of a systemd call, from the recorded history of
+ *         the same call, or a default when it has not been seen yet.
+ */
+std::chrono::milliseconds estimateSystemdDuration(const std::string& method,
+                                                  const std::string& units);
@@ -0,0 +1,255 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "alloc_accounting.hpp"
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+// Replaces the global operator new and delete. Every block carries a header
+// with its size and subsystem, right in front of the pointer handed out. The
+// daemon is single threaded, so the counters are plain integers.
+
+namespace phosphor
+{
+namespace service
+{
+
+static AllocStatsArray allocStats{};
+static AllocSubsystem currentSubsystem = AllocSubsystem::other;
+static AllocSubsystem defaultSubsystem = AllocSubsystem::other;
+static size_t scopeDepth = 0;
+
+struct alignas(alignof(std::max_align_t)) AllocHeader
+{
+    size_t size;
+    // Distance from the start of the underlying block to the pointer
+    uint32_t offset;
+    AllocSubsystem subsystem;
+};
+
+AllocScope::AllocScope(AllocSubsystem subsystem) : previous(currentSubsystem)
+{
+    currentSubsystem = subsystem;
+    scopeDepth++;
+}
+
+AllocScope::~AllocScope()
+{
+    currentSubsystem = previous;
+    scopeDepth--;
+}
+
+void setDefaultAllocSubsystem(AllocSubsystem subsystem)
+{
+    defaultSubsystem = subsystem;
+}
+
+const char* allocSubsystemName(AllocSubsystem subsystem)
+{
+    switch (subsystem)
+    {
+        case AllocSubsystem::discovery:
+            return "Discovery";
+        case AllocSubsystem::objectServer:
+            return "ObjectServer";
+        case AllocSubsystem::persistence:
+            return "Persistence";
+        case AllocSubsystem::apply:
+            return "Apply";
+        case AllocSubsystem::other:
+        case AllocSubsystem::count:
+            break;
+    }
+    return "Other";
+}
+
+AllocStatsArray getAllocStats()
+{
+    return allocStats;
+}
+
+static void* allocate(size_t size, size_t alignment) noexcept
+{
+    size_t offset = std::max(alignment, sizeof(AllocHeader));
+    void* block = nullptr;
+    if (alignment <= alignof(std::max_align_t))
+    {
+        block = std::malloc(offset + size);
+    }
+    else
+    {
+        // aligned_alloc() wants a multiple of the alignment
+        size_t total = (offset + size + alignment - 1) & ~(alignment - 1);
+        block = std::aligned_alloc(alignment, total);
+    }
+    if (block == nullptr)
+    {
+        return nullptr;
+    }
+
+    AllocSubsystem subsystem = scopeDepth ? currentSubsystem
+                                          : defaultSubsystem;
+    auto* ptr = static_cast<char*>(block) + offset;
+    auto* header = reinterpret_cast<AllocHeader*>(ptr) - 1;
+    header->size = size;
+    header->offset = static_cast<uint32_t>(offset);
+    header->subsystem = subsystem;
+
+    AllocStats& stats = allocStats[static_cast<size_t>(subsystem)];
+    stats.liveBytes += size;
+    stats.peakBytes = std::max(stats.peakBytes, stats.liveBytes);
+    stats.allocations++;
+    stats.liveAllocations++;
+    return ptr;
+}
+
+static void deallocate(void* ptr) noexcept
+{
+    if (ptr == nullptr)
+    {
+        return;
+    }
+    auto* header = static_cast<AllocHeader*>(ptr) - 1;
+    AllocStats& stats = allocStats[static_cast<size_t>(header->subsystem)];
+    stats.liveBytes -= header->size;
+    stats.liveAllocations--;
+    std::free(static_cast<char*>(ptr) - header->offset);
+}
+
+static void* allocateOrThrow(size_t size, size_t alignment)
+{
+    void* ptr = allocate(size, alignment);
+    if (ptr == nullptr)
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+} // namespace service
+} // namespace phosphor
+
+using phosphor::service::allocate;
+using phosphor::service::allocateOrThrow;
+using phosphor::service::deallocate;
+
+static constexpr size_t defaultAlignment = alignof(std::max_align_t);
+
+void* operator new(size_t size)
+{
+    return allocateOrThrow(size, defaultAlignment);
+}
+
+void* operator new[](size_t size)
+{
+    return allocateOrThrow(size, defaultAlignment);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size, defaultAlignment);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return allocate(size, defaultAlignment);
+}
+
+void* operator new(size_t size, std::align_val_t alignment)
+{
+    return allocateOrThrow(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment)
+{
+    return allocateOrThrow(size, static_cast<size_t>(alignment));
+}
+
+void* operator new(size_t size, std::align_val_t alignment,
+                   const std::nothrow_t&) noexcept
+{
+    return allocate(size, static_cast<size_t>(alignment));
+}
+
+void* operator new[](size_t size, std::align_val_t alignment,
+                     const std::nothrow_t&) noexcept
+{
+    return allocate(size, static_cast<size_t>(alignment));
+}
+
+void operator delete(void* ptr) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete(void* ptr, std::align_val_t,
+                     const std::nothrow_t&) noexcept
+{
+    deallocate(ptr);
+}
+
+void operator delete[](void* ptr, std::align_val_t,
+                       const std::nothrow_t&) noexcept
+{
+    deallocate(ptr);
+}
@@ -0,0 +1,128 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "loop_monitor.hpp"
+
+#include "srvcfg_manager.hpp"
+
+#include <systemd/sd-daemon.h>
+
+#include <bit>
+
+namespace phosphor
+{
+namespace service
+{
+
+static constexpr const auto defaultProbeInterval = std::chrono::seconds(1);
+
+LoopMonitor::LoopMonitor(boost::asio::io_context& io,
+                         sdbusplus::asio::object_server& server) :
+    probeTimer(io), probeInterval(defaultProbeInterval)
+{
+    uint64_t watchdogUsec = 0;
+    if (sd_watchdog_enabled(0, &watchdogUsec) > 0)
+    {
+        // Probe (and kick) four times per watchdog period, so one late
+        // probe doesn't trip it but a wedged loop does
+        watchdogInterval = std::chrono::microseconds(watchdogUsec);
+        probeInterval = std::min<std::chrono::microseconds>(
+            probeInterval, watchdogInterval / 4);
+        lg2::info("Watchdog enabled, interval {USEC} us", "USEC",
+                  watchdogUsec);
+    }
+
+    iface = server.add_interface(srcCfgMgrBasePath, loopLatencyIntfName);
+    iface->register_property_r(
+        "LagP50", uint64_t{0}, sdbusplus::vtable::property_::none,
+        [this](const uint64_t&) { return percentile(0.5); });
+    iface->register_property_r(
+        "LagP99", uint64_t{0}, sdbusplus::vtable::property_::none,
+        [this](const uint64_t&) { return percentile(0.99); });
+    iface->register_property_r(
+        "LagMax", uint64_t{0}, sdbusplus::vtable::property_::none,
+        [this](const uint64_t&) { return maxLagUsec; });
+    iface->register_property_r(
+        "LagHistogram", std::vector<uint64_t>{},
+        sdbusplus::vtable::property_::none,
+        [this](const std::vector<uint64_t>&) {
+            return std::vector<uint64_t>(histogram.begin(), histogram.end());
+        });
+    iface->initialize();
+
+    arm();
+}
+
+void LoopMonitor::arm()
+{
+    expectedFire = std::chrono::steady_clock::now() + probeInterval;
+    probeTimer.expires_at(expectedFire);
+    probeTimer.async_wait(
+        [this](const boost::system::error_code& ec) { onProbe(ec); });
+}
+
+void LoopMonitor::onProbe(const boost::system::error_code& ec)
+{
+    if (ec)
+    {
+        lg2::error("Loop latency probe wait error: {EC}", "EC", ec.value());
+        return;
+    }
+    auto lag = std::chrono::duration_cast<std::chrono::microseconds>(
+        std::chrono::steady_clock::now() - expectedFire);
+    uint64_t lagUsec = std::max<int64_t>(lag.count(), 0);
+    record(lagUsec);
+
+    if (watchdogInterval.count() != 0)
+    {
+        if (lag < watchdogInterval / 2)
+        {
+            sd_notify(0, "WATCHDOG=1");
+        }
+        else
+        {
+            lg2::error("Event loop lagged {USEC} us, not kicking watchdog",
+                       "USEC", lagUsec);
+        }
+    }
+    arm();
+}
+
+void LoopMonitor::record(uint64_t lagUsec)
+{
+    size_t bucket = std::min<size_t>(std::bit_width(lagUsec), lagBuckets - 1);
+    ++histogram[bucket];
+    ++samples;
+    maxLagUsec = std::max(maxLagUsec, lagUsec);
+}
+
+uint64_t LoopMonitor::percentile(double fraction) const
+{
+    // Upper bound of the bucket holding the requested sample
+    uint64_t target = static_cast<uint64_t>(fraction * samples);
+    uint64_t seen = 0;
+    for (size_t bucket = 0; bucket < lagBuckets; ++bucket)
+    {
+        seen += histogram[bucket];
+        if (seen > target)
+        {
+            return std::min(maxLagUsec, (uint64_t{1} << bucket) - 1);
+        }
+    }
+    return maxLagUsec;
+}
+
+} // namespace service
+} // namespace phosphor
@@ -13,33 +13,40 @@
 // See the License for the specific language governing permissions and
 // limitations under the License.
 */
+#include "alloc_accounting.hpp"
+#include "loop_monitor.hpp"
+#include "monitor_list.hpp"
+#include "persist_codec.hpp"
+#include "srvcfg_bulk.hpp"
 #include "srvcfg_manager.hpp"
+#include "startup_profiler.hpp"
+#include "unit_file_watcher.hpp"
 
 #include <boost/algorithm/string/replace.hpp>
-#include <cereal/archives/json.hpp>
-#include <cereal/types/tuple.hpp>
-#include <cereal/types/unordered_map.hpp>
-#include <sdbusplus/bus/match.hpp>
 
+#include <array>
 #include <csignal>
+#include <cstdlib>
 #include <filesystem>
-#include <fstream>
+#include <stdexcept>
 #include <unordered_map>
 
 std::unique_ptr<boost::asio::steady_timer> timer = nullptr;
-std::unique_ptr<boost::asio::steady_timer> initTimer = nullptr;
-std::map<std::string, std::shared_ptr<phosphor::service::ServiceConfig>>
-    srvMgrObjects;
-static bool unitQueryStarted = false;
+phosphor::service::UnitRegistry srvMgrObjects;
+std::unique_ptr<phosphor::service::UnitFileWatcher> unitFileWatcher = nullptr;
 
 static constexpr const char* srvCfgMgrFileOld = "/etc/srvcfg-mgr.json";
+// The JSON monitor list of earlier versions, migrated to monitorListFile
 static constexpr const char* srvCfgMgrFile = "srvcfg-mgr.json";
-static constexpr const char* tmpFileBad = "/tmp/srvcfg-mgr.json.bad";
+static constexpr const char* monitorListFile = "srvcfg-mgr.list";
+static constexpr const char* monitorListSchema = "monitored-units";
+static constexpr const uint32_t monitorListVersion = 1;
+static constexpr const char* tmpFileBad = "/tmp/srvcfg-mgr.list.bad";
 
 // Base service name list. All instance of these services and
 // units(service/socket) will be managed by this daemon.
-static std::unordered_map<std::string /* unitName */,
-                          bool /* isSocketActivated */>
+static std::map<std::string /* unitName */, bool /* isSocketActivated */,
+                std::less<>>
     managedServices = {{"phosphor-ipmi-net", false}, {"bmcweb", false},
                        {"phosphor-ipmi-kcs", false}, {"obmc-ikvm", false},
                        {"obmc-console", false},      {"dropbear", true},
@@ -54,28 +61,21 @@ enum class UnitType
     invalid
 };
 
-using MonitorListMap =
-    std::unordered_map<std::string, std::tuple<std::string, std::string,
-                                               std::string, std::string>>;
-MonitorListMap unitsToMonitor;
+using phosphor::service::MonitorListMap;
+using phosphor::service::monitorElement;
 
-enum class monitorElement
-{
-    unitName,
-    instanceName,
-    serviceObjPath,
-    socketObjPath
-};
+MonitorListMap unitsToMonitor;
 
-std::tuple<std::string, UnitType, std::string> getUnitNameTypeAndInstance(
-    const std::string& fullUnitName)
+// The returned views point into fullUnitName
+std::tuple<std::string_view, UnitType, std::string_view>
+    getUnitNameTypeAndInstance(std::string_view fullUnitName)
 {
     UnitType type = UnitType::invalid;
-    std::string instanceName;
-    std::string unitName;
+    std::string_view instanceName;
+    std::string_view unitName;
     // get service type
     auto typePos = fullUnitName.rfind(".");
-    if (typePos != std::string::npos)
+    if (typePos != std::string_view::npos)
     {
         const auto& typeStr = fullUnitName.substr(typePos + 1);
         // Ignore types other than service and socket
@@ -89,7 +89,7 @@ std::tuple<std::string, UnitType, std::string> getUnitNameTypeAndInstance(
         }
         // get instance name if available
         auto instancePos = fullUnitName.rfind("@");
-        if (instancePos != std::string::npos)
+        if (instancePos != std::string_view::npos)
         {
             instanceName =
                 fullUnitName.substr(instancePos + 1, typePos - instancePos - 1);
@@ -103,72 +103,163 @@ std::tuple<std::string, UnitType, std::string> getUnitNameTypeAndInstance(
     return std::make_tuple(unitName, type, instanceName);
 }
 
-static inline void handleListUnitsResponse(
-    sdbusplus::asio::object_server& server,
-    std::shared_ptr<sdbusplus::asio::connection>& conn,
-    boost::system::error_code /*ec*/,
-    const std::vector<ListUnitsType>& listUnits)
+static void addUnitToMonitor(const ListedUnit& unit)
 {
-    // Loop through all units, and mark all units, which has to be
-    // managed, irrespective of instance name.
-    for (const auto& unit : listUnits)
+    // Ignore non-existent units
+    if (unit.loadState == loadStateNotFound)
+    {
+        return;
+    }
+
+    // Everything up to here works on views into the reply, so the units we
+    // don't manage (nearly all of them) are skipped without allocating.
+    auto [unitName, type, instanceName] = getUnitNameTypeAndInstance(unit.name);
+    auto managedIt = managedServices.find(unitName);
+    if (managedIt == managedServices.end())
     {
-        // Ignore non-existent units
-        if (std::get<static_cast<int>(ListUnitElements::loadState)>(unit) ==
-            loadStateNotFound)
+        return;
+    }
+    // For socket-activated units, ignore all its instances
+    if (managedIt->second == true && !instanceName.empty())
+    {
+        return;
+    }
+
+    std::string instantiatedUnitName(unitName);
+    if (!instanceName.empty())
+    {
+        instantiatedUnitName += "@";
+        instantiatedUnitName += instanceName;
+    }
+    std::string objectPath(unit.objectPath);
+    // Group the service & socket units together.. Same services
+    // are managed together.
+    auto it = unitsToMonitor.find(instantiatedUnitName);
+    if (it != unitsToMonitor.end())
+    {
+        auto& value = it->second;
+        if (type == UnitType::service)
         {
-            continue;
+            std::get<static_cast<int>(monitorElement::serviceObjPath)>(value) =
+                std::move(objectPath);
         }
-
-        const auto& fullUnitName =
-            std::get<static_cast<int>(ListUnitElements::name)>(unit);
-        auto [unitName, type,
-              instanceName] = getUnitNameTypeAndInstance(fullUnitName);
-        if (managedServices.count(unitName))
+        else if (type == UnitType::socket)
         {
-            // For socket-activated units, ignore all its instances
-            if (managedServices.at(unitName) == true && !instanceName.empty())
+            std::get<static_cast<int>(monitorElement::socketObjPath)>(value) =
+                std::move(objectPath);
+        }
+        return;
+    }
+    // If not grouped with any existing entry, create a new one
+    if (type == UnitType::service)
+    {
+        unitsToMonitor.emplace(
+            std::move(instantiatedUnitName),
+            std::make_tuple(std::string(unitName), std::string(instanceName),
+                            std::move(objectPath), ""));
+    }
+    else if (type == UnitType::socket)
+    {
+        unitsToMonitor.emplace(
+            std::move(instantiatedUnitName),
+            std::make_tuple(std::string(unitName), std::string(instanceName),
+                            "", std::move(objectPath)));
+    }
+}
+
+static std::string monitorListKey(std::string_view unitName,
+                                  std::string_view instanceName)
+{
+    std::string key(unitName);
+    if (!instanceName.empty())
+    {
+        key += "@";
+        key += instanceName;
+    }
+    return key;
+}
+
+static void loadMonitorList(const std::string& path,
+                            MonitorListMap& monitorList)
+{
+    auto result = phosphor::service::readPersistFile(
+        path, monitorListSchema, monitorListVersion,
+        [&monitorList](phosphor::service::PersistRecord record) {
+            if (record.size() == 5)
             {
-                continue;
+                monitorList.emplace(
+                    std::string(record[0]),
+                    std::make_tuple(std::string(record[1]),
+                                    std::string(record[2]),
+                                    std::string(record[3]),
+                                    std::string(record[4])));
             }
+        });
+    if (result != phosphor::service::PersistReadResult::ok)
+    {
+        throw std::runtime_error("Unreadable monitor list");
+    }
+}
 
-            std::string instantiatedUnitName =
-                unitName + addInstanceName(instanceName, "@");
-            const sdbusplus::object_path& objectPath =
-                std::get<static_cast<int>(ListUnitElements::objectPath)>(unit);
-            // Group the service & socket units together.. Same services
-            // are managed together.
-            auto it = unitsToMonitor.find(instantiatedUnitName);
-            if (it != unitsToMonitor.end())
+// Read the monitor list cereal wrote in earlier versions: a list of key and
+// value members, the value being a tuple of tuple_element0..3
+static void loadLegacyMonitorList(const std::string& path,
+                                  MonitorListMap& monitorList)
+{
+    std::array<std::string_view, 4> elements;
+    bool parsed = phosphor::service::forEachLegacyJsonValue(
+        path, [&](std::string_view name, std::string_view value) {
+            if (!name.starts_with("tuple_element") ||
+                name.size() != std::string_view("tuple_element0").size())
             {
-                auto& value = it->second;
-                if (type == UnitType::service)
-                {
-                    std::get<static_cast<int>(monitorElement::serviceObjPath)>(
-                        value) = objectPath.str;
-                }
-                else if (type == UnitType::socket)
-                {
-                    std::get<static_cast<int>(monitorElement::socketObjPath)>(
-                        value) = objectPath.str;
-                }
-                continue;
+                return;
             }
-            // If not grouped with any existing entry, create a new one
-            if (type == UnitType::service)
+            size_t index = name.back() - '0';
+            if (index >= elements.size())
             {
-                unitsToMonitor.emplace(instantiatedUnitName,
-                                       std::make_tuple(unitName, instanceName,
-                                                       objectPath.str, ""));
+                return;
             }
-            else if (type == UnitType::socket)
+            elements[index] = value;
+            if (index == elements.size() - 1)
             {
-                unitsToMonitor.emplace(instantiatedUnitName,
-                                       std::make_tuple(unitName, instanceName,
-                                                       "", objectPath.str));
+                monitorList.emplace(
+                    monitorListKey(elements[0], elements[1]),
+                    std::make_tuple(
+                        std::string(elements[0]), std::string(elements[1]),
+                        std::string(elements[2]), std::string(elements[3])));
             }
-        }
+        });
+    if (!parsed)
+    {
+        throw std::runtime_error("Unreadable legacy monitor list");
     }
+}
+
+static void saveMonitorList(const std::string& path,
+                            const MonitorListMap& monitorList)
+{
+    phosphor::service::PersistWriter writer(path, monitorListSchema,
+                                            monitorListVersion);
+    for (const auto& [key, value] : monitorList)
+    {
+        const auto& [unitName, instanceName, serviceObjPath, socketObjPath] =
+            value;
+        writer.record(
+            {key, unitName, instanceName, serviceObjPath, socketObjPath});
+    }
+    writer.commit();
+}
+
+static inline void handleListUnitsResponse(
+    sdbusplus::asio::object_server& server,
+    std::shared_ptr<sdbusplus::asio::connection>& conn,
+    boost::system::error_code /*ec*/, sdbusplus::message_t& listUnits)
+{
+    phosphor::service::AllocScope allocScope(
+        phosphor::service::AllocSubsystem::discovery);
+    // Loop through all units, and mark all units, which has to be
+    // managed, irrespective of instance name.
+    forEachListedUnit(listUnits, addUnitToMonitor);
 
     bool updateRequired = false;
 
@@ -179,11 +270,13 @@ static inline void handleListUnitsResponse(
     }
 
     std::string srvCfgMgrFilePath = std::string(srvDataBaseDir) + srvCfgMgrFile;
+    std::string monitorListPath = std::string(srvDataBaseDir) + monitorListFile;
 
     // First check if our config manager file is in the old spot.
     // If it is, then move it to the new spot
     if ((std::filesystem::exists(srvCfgMgrFileOld)) &&
-        (!std::filesystem::exists(srvCfgMgrFilePath)))
+        (!std::filesystem::exists(srvCfgMgrFilePath)) &&
+        (!std::filesystem::exists(monitorListPath)))
     {
         lg2::info("Moving {OLDFILEPATH} to new location, {FILEPATH}",
                   "OLDFILEPATH", srvCfgMgrFileOld, "FILEPATH",
@@ -194,37 +287,45 @@ static inline void handleListUnitsResponse(
         std::filesystem::remove(srvCfgMgrFileOld);
     }
 
-    bool jsonExist = std::filesystem::exists(srvCfgMgrFilePath);
-    if (jsonExist)
+    bool listExist = std::filesystem::exists(monitorListPath);
+    bool legacyExist = !listExist && std::filesystem::exists(srvCfgMgrFilePath);
+    if (listExist || legacyExist)
     {
+        std::string loadPath = listExist ? monitorListPath : srvCfgMgrFilePath;
         try
         {
-            std::ifstream file(srvCfgMgrFilePath);
-            cereal::JSONInputArchive archive(file);
             MonitorListMap savedMonitorList;
-            archive(savedMonitorList);
+            if (listExist)
+            {
+                loadMonitorList(monitorListPath, savedMonitorList);
+            }
+            else
+            {
+                lg2::info("Migrating {OLDFILEPATH} to {FILEPATH}",
+                          "OLDFILEPATH", srvCfgMgrFilePath, "FILEPATH",
+                          monitorListPath);
+                loadLegacyMonitorList(srvCfgMgrFilePath, savedMonitorList);
+                updateRequired = true;
+            }
 
             // compare the unit list read from systemd1 and the save list.
-            MonitorListMap diffMap;
-            std::set_difference(begin(unitsToMonitor), end(unitsToMonitor),
-                                begin(savedMonitorList), end(savedMonitorList),
-                                std::inserter(diffMap, begin(diffMap)));
-            for (auto& unitIt : diffMap)
+            auto changes = phosphor::service::reconcileMonitorList(
+                unitsToMonitor, savedMonitorList);
+            if (changes.added || changes.removed || changes.changed)
             {
-                auto it = savedMonitorList.find(unitIt.first);
-                if (it == savedMonitorList.end())
-                {
-                    savedMonitorList.insert(unitIt);
-                    updateRequired = true;
-                }
+                lg2::info("Monitored units changed: {ADDED} added, {REMOVED} "
+                          "removed, {CHANGED} changed",
+                          "ADDED", changes.added, "REMOVED", changes.removed,
+                          "CHANGED", changes.changed);
+                updateRequired = true;
             }
-            unitsToMonitor = savedMonitorList;
+            unitsToMonitor = std::move(savedMonitorList);
         }
         catch (const std::exception& e)
         {
             lg2::error(
                 "Failed to load {FILEPATH} file, need to rewrite: {ERROR}.",
-                "FILEPATH", srvCfgMgrFilePath, "ERROR", e);
+                "FILEPATH", loadPath, "ERROR", e);
 
             // The "bad" files need to be moved to /tmp/ so that we can try to
             // find out the cause of the file corruption. If we encounter this
@@ -232,31 +333,32 @@ static inline void handleListUnitsResponse(
             // we don't accidentally fill up /tmp/.
             std::error_code ec;
             std::filesystem::copy_file(
-                srvCfgMgrFilePath, tmpFileBad,
+                loadPath, tmpFileBad,
                 std::filesystem::copy_options::overwrite_existing, ec);
             if (ec)
             {
                 lg2::error("Failed to copy {SRCFILE} file to {DSTFILE}.",
-                           "SRCFILE", srvCfgMgrFilePath, "DSTFILE", tmpFileBad);
+                           "SRCFILE", loadPath, "DSTFILE", tmpFileBad);
             }
 
             updateRequired = true;
         }
     }
-    if (!jsonExist || updateRequired)
+    if (!listExist || updateRequired)
     {
-        std::ofstream file(srvCfgMgrFilePath);
-        cereal::JSONOutputArchive archive(file);
-        archive(CEREAL_NVP(unitsToMonitor));
+        saveMonitorList(monitorListPath, unitsToMonitor);
+        if (legacyExist)
+        {
+            std::error_code ec;
+            std::filesystem::remove(srvCfgMgrFilePath, ec);
+        }
     }
 
 #ifdef USB_CODE_UPDATE
     unitsToMonitor.emplace(
         "phosphor-usb-code-update",
-        std::make_tuple(
-            phosphor::service::usbCodeUpdateUnitName, "",
-            "/org/freedesktop/systemd1/unit/usb_2dcode_2dupdate_2eservice",
-            ""));
+        std::make_tuple(phosphor::service::usbCodeUpdateUnitName, "",
+                        phosphor::service::usbCodeUpdateServiceObjPath, ""));
 #endif
 
     // create objects for needed services
@@ -264,98 +366,103 @@ static inline void handleListUnitsResponse(
     {
         sdbusplus::object_path basePath(phosphor::service::srcCfgMgrBasePath);
         std::string objPath(basePath / it.first);
-        auto srvCfgObj = std::make_unique<phosphor::service::ServiceConfig>(
+        auto srvCfgObj = std::make_shared<phosphor::service::ServiceConfig>(
             server, conn, objPath,
             std::get<static_cast<int>(monitorElement::unitName)>(it.second),
             std::get<static_cast<int>(monitorElement::instanceName)>(it.second),
-            std::get<static_cast<int>(monitorElement::serviceObjPath)>(
-                it.second),
-            std::get<static_cast<int>(monitorElement::socketObjPath)>(
-                it.second));
-        srvMgrObjects.emplace(
-            std::make_pair(std::move(objPath), std::move(srvCfgObj)));
+            !std::get<static_cast<int>(monitorElement::serviceObjPath)>(
+                 it.second)
+                 .empty(),
+            !std::get<static_cast<int>(monitorElement::socketObjPath)>(
+                 it.second)
+                 .empty());
+        if (srvMgrObjects.add(objPath, srvCfgObj).generation != 0)
+        {
+            unitFileWatcher->addObject(srvCfgObj);
+            // Read the initial systemd state, now that async replies can find
+            // the object through its handle
+            srvCfgObj->reloadServiceConfig();
+        }
     }
 }
 
 void init(sdbusplus::asio::object_server& server,
           std::shared_ptr<sdbusplus::asio::connection>& conn)
 {
+    phosphor::service::startStartupPhase(
+        phosphor::service::StartupPhase::listUnits);
     // Go through all systemd units, and dynamically detect and manage
     // the service daemons
     conn->async_method_call(
         [&server, &conn](boost::system::error_code ec,
-                         const std::vector<ListUnitsType>& listUnits) {
-            if (ec)
-            {
-                lg2::error("async_method_call error: ListUnits failed: {EC}",
-                           "EC", ec.value());
-                return;
-            }
-            handleListUnitsResponse(server, conn, ec, listUnits);
-        },
-        sysdService, sysdObjPath, sysdMgrIntf, "ListUnits");
-}
-
-void checkAndInit(sdbusplus::asio::object_server& server,
-                  std::shared_ptr<sdbusplus::asio::connection>& conn)
-{
-    // Check whether systemd completed all the loading before initializing
-    conn->async_method_call(
-        [&server, &conn](boost::system::error_code ec,
-                         const std::variant<uint64_t>& value) {
+                         sdbusplus::message_t& listUnits) {
             if (ec)
             {
                 lg2::error("async_method_call error: ListUnits failed: {EC}",
                            "EC", ec.value());
+                // Nothing will be managed, don't hold up dependent units
+                phosphor::service::notifyReadyEarly(
+                    "Failed to list systemd units");
                 return;
             }
-            if (std::get<uint64_t>(value))
+            try
             {
-                if (!unitQueryStarted)
-                {
-                    unitQueryStarted = true;
-                    init(server, conn);
-                }
+                handleListUnitsResponse(server, conn, ec, listUnits);
             }
-            else
+            catch (const std::exception& e)
             {
-                // FIX-ME: Latest up-stream sync caused issue in receiving
-                // StartupFinished signal. Unable to get StartupFinished signal
-                // from systemd1 hence using poll method too, to trigger it
-                // properly.
-                constexpr size_t pollTimeout = 10; // seconds
-                initTimer->expires_after(std::chrono::seconds(pollTimeout));
-                initTimer->async_wait([&server, &conn](
-                                          const boost::system::error_code& ec) {
-                    if (ec == boost::asio::error::operation_aborted)
-                    {
-                        // Timer reset.
-                        return;
-                    }
-                    if (ec)
-                    {
-                        lg2::error(
-                            "service config mgr - init - async wait error: {EC}",
-                            "EC", ec.value());
-                        return;
-                    }
-                    checkAndInit(server, conn);
-                });
+                lg2::error("Failed to handle ListUnits response: {ERROR}",
+                           "ERROR", e);
             }
+            phosphor::service::endStartupPhase(
+                phosphor::service::StartupPhase::listUnits);
+            phosphor::service::expectStartupObjects(srvMgrObjects.size());
         },
-        sysdService, sysdObjPath, dBusPropIntf, dBusGetMethod, sysdMgrIntf,
-        "FinishTimestamp");
+        sysdService, sysdObjPath, sysdMgrIntf, "ListUnits");
 }
 
-int main()
+int main(int argc, char* argv[])
 {
+    for (int i = 1; i < argc; i++)
+    {
+        if (std::string_view(argv[i]) == "--dry-run")
+        {
+            // Changes are staged and planned, but never applied
+            lg2::info("Dry run mode, changes are not applied");
+            phosphor::service::setDryRun(true);
+        }
+        else
+        {
+            lg2::error("Unknown argument {ARG}", "ARG", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    phosphor::service::startStartupPhase(
+        phosphor::service::StartupPhase::busConnect);
     boost::asio::io_context io;
     auto conn = std::make_shared<sdbusplus::asio::connection>(io);
+    // systemd calls, their (possibly large) replies and signals go over a
+    // connection of their own, so that they never queue up behind or ahead
+    // of client requests to the object server on the primary one. This needs
+    // a new bus rather than the shared default one.
+    auto systemdConn = std::make_shared<sdbusplus::asio::connection>(
+        io, sdbusplus::bus::new_system().release());
+    // Unit actions need the job results, from before the first one
+    watchJobResults(systemdConn);
     timer = std::make_unique<boost::asio::steady_timer>(io);
-    initTimer = std::make_unique<boost::asio::steady_timer>(io);
     conn->request_name(phosphor::service::serviceConfigSrvName);
+    phosphor::service::endStartupPhase(
+        phosphor::service::StartupPhase::busConnect);
+    unitFileWatcher =
+        std::make_unique<phosphor::service::UnitFileWatcher>(io, systemdConn,
+                                                             srvMgrObjects);
     auto server = sdbusplus::asio::object_server(conn, true);
     server.add_manager(phosphor::service::srcCfgMgrBasePath);
+    phosphor::service::registerStartupInterface(server);
+    auto bulkIface =
+        phosphor::service::registerBulkInterface(server, systemdConn);
+    phosphor::service::LoopMonitor loopMonitor(io, server);
 
     // SIGHUP signal handler to reload service configuration from persistent
     // storage. In redundant BMC systems, this enables automatic configuration
@@ -410,22 +517,10 @@ int main()
     };
     signals.async_wait(sighupHandler);
 
-    // Initialize the objects after systemd indicated startup finished.
-    auto userUpdatedSignal = std::make_unique<sdbusplus::bus::match_t>(
-        static_cast<sdbusplus::bus_t&>(*conn),
-        "type='signal',"
-        "member='StartupFinished',path='/org/freedesktop/systemd1',"
-        "interface='org.freedesktop.systemd1.Manager'",
-        [&server, &conn](sdbusplus::message_t& /*msg*/) {
-            if (!unitQueryStarted)
-            {
-                unitQueryStarted = true;
-                init(server, conn);
-            }
-        });
-    // this will make sure to initialize the objects, when daemon is
-    // restarted.
-    checkAndInit(server, conn);
+    // Units are listed right away rather than after the boot finishes: our
+    // own start job is part of the boot, and READY=1 is only sent once
+    // every object is published
+    init(server, systemdConn);
 
     io.run();
 
@@ -0,0 +1,177 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "monitor_list.hpp"
+
+#include <phosphor-logging/lg2.hpp>
+
+#include <array>
+#include <filesystem>
+#include <optional>
+#include <unordered_set>
+#include <vector>
+
+namespace phosphor
+{
+namespace service
+{
+
+// Where systemd looks for unit files, most specific first
+static constexpr std::array<const char*, 4> unitFileDirs = {
+    "/etc/systemd/system", "/run/systemd/system", "/usr/lib/systemd/system",
+    "/lib/systemd/system"};
+
+// Names of the units enabled through a .wants or .requires symlink
+static std::unordered_set<std::string> enabledUnitLinks()
+{
+    std::unordered_set<std::string> links;
+    std::error_code ec;
+    for (const char* dir : unitFileDirs)
+    {
+        for (const auto& linkDir : std::filesystem::directory_iterator(dir, ec))
+        {
+            const std::string linkDirName = linkDir.path().filename();
+            if (!linkDirName.ends_with(".wants") &&
+                !linkDirName.ends_with(".requires"))
+            {
+                continue;
+            }
+            for (const auto& link :
+                 std::filesystem::directory_iterator(linkDir.path(), ec))
+            {
+                links.insert(link.path().filename());
+            }
+        }
+    }
+    return links;
+}
+
+// Whether the unit files of a monitor list entry are still installed. Units
+// that are not loaded are missing from ListUnits, so that alone doesn't mean
+// they are gone. An instance stays installed as long as its template does,
+// so it also needs a unit file or an enablement symlink of its own; the
+// symlinks are only collected, once, if such an entry comes up.
+static bool monitoredUnitInstalled(
+    const MonitorListMap::mapped_type& value,
+    std::optional<std::unordered_set<std::string>>& links)
+{
+    const auto& unitName =
+        std::get<static_cast<int>(monitorElement::unitName)>(value);
+    const auto& instanceName =
+        std::get<static_cast<int>(monitorElement::instanceName)>(value);
+    std::vector<std::string> suffixes;
+    if (!std::get<static_cast<int>(monitorElement::serviceObjPath)>(value)
+             .empty())
+    {
+        suffixes.emplace_back(".service");
+    }
+    if (!std::get<static_cast<int>(monitorElement::socketObjPath)>(value)
+             .empty())
+    {
+        suffixes.emplace_back(".socket");
+    }
+    auto unitFileExists = [](const std::string& unitFile) {
+        std::error_code ec;
+        for (const char* dir : unitFileDirs)
+        {
+            if (std::filesystem::exists(std::filesystem::path(dir) / unitFile,
+                                        ec))
+            {
+                return true;
+            }
+        }
+        return false;
+    };
+    for (const auto& suffix : suffixes)
+    {
+        if (instanceName.empty())
+        {
+            if (unitFileExists(unitName + suffix))
+            {
+                return true;
+            }
+            continue;
+        }
+        std::string instanceFile = unitName + "@" + instanceName + suffix;
+        if (!unitFileExists(unitName + "@" + suffix))
+        {
+            continue;
+        }
+        if (!links)
+        {
+            links = enabledUnitLinks();
+        }
+        if (links->contains(instanceFile) || unitFileExists(instanceFile))
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+MonitorListChanges reconcileMonitorList(const MonitorListMap& listed,
+                                        MonitorListMap& saved)
+{
+    MonitorListChanges changes;
+    for (const auto& [key, value] : listed)
+    {
+        auto it = saved.find(key);
+        if (it == saved.end())
+        {
+            saved.emplace(key, value);
+            changes.added++;
+            continue;
+        }
+        // A listed unit may have only one of its units loaded, an empty path
+        // says nothing about the other
+        bool changed = false;
+        auto updatePath = [&changed](std::string& savedPath,
+                                     const std::string& listedPath) {
+            if (!listedPath.empty() && listedPath != savedPath)
+            {
+                savedPath = listedPath;
+                changed = true;
+            }
+        };
+        updatePath(
+            std::get<static_cast<int>(monitorElement::serviceObjPath)>(
+                it->second),
+            std::get<static_cast<int>(monitorElement::serviceObjPath)>(value));
+        updatePath(
+            std::get<static_cast<int>(monitorElement::socketObjPath)>(
+                it->second),
+            std::get<static_cast<int>(monitorElement::socketObjPath)>(value));
+        if (changed)
+        {
+            changes.changed++;
+        }
+    }
+    std::optional<std::unordered_set<std::string>> links;
+    std::erase_if(saved, [&listed, &changes, &links](const auto& entry) {
+        if (listed.contains(entry.first) ||
+            monitoredUnitInstalled(entry.second, links))
+        {
+            return false;
+        }
+        lg2::info("Unit {UNIT} is no longer installed, not monitoring it",
+                  "UNIT", entry.first);
+        changes.removed++;
+        return true;
+    });
+    return changes;
+}
+
+} // namespace service
+} // namespace phosphor
@@ -0,0 +1,255 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "persist_codec.hpp"
+
+#include <phosphor-logging/lg2.hpp>
+
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+
+namespace phosphor
+{
+namespace service
+{
+
+static std::string persistHeader(std::string_view schema, uint32_t version)
+{
+    return std::string(schema) + " " + std::to_string(version);
+}
+
+// Read a line into buffer, without the newline. Returns false at the end of
+// the file, and sets tooLong when the line doesn't fit.
+static bool readLine(std::FILE* file,
+                     std::array<char, persistMaxLineLength>& buffer,
+                     std::string_view& line, bool& tooLong)
+{
+    if (!std::fgets(buffer.data(), buffer.size(), file))
+    {
+        return false;
+    }
+    line = std::string_view(buffer.data());
+    if (line.ends_with('\n'))
+    {
+        line.remove_suffix(1);
+    }
+    else if (!std::feof(file))
+    {
+        tooLong = true;
+    }
+    return true;
+}
+
+PersistReadResult readPersistFile(
+    const std::string& path, std::string_view schema, uint32_t version,
+    const std::function<void(PersistRecord)>& callback)
+{
+    std::FILE* file = std::fopen(path.c_str(), "re");
+    if (!file)
+    {
+        return errno == ENOENT ? PersistReadResult::missing
+                               : PersistReadResult::corrupt;
+    }
+    std::array<char, persistMaxLineLength> buffer;
+    std::string_view line;
+    bool tooLong = false;
+    PersistReadResult result = PersistReadResult::ok;
+    if (!readLine(file, buffer, line, tooLong) || tooLong ||
+        line != persistHeader(schema, version))
+    {
+        result = PersistReadResult::otherFormat;
+    }
+
+    std::array<std::string_view, persistMaxFields> fields;
+    while (result == PersistReadResult::ok &&
+           readLine(file, buffer, line, tooLong))
+    {
+        if (tooLong)
+        {
+            result = PersistReadResult::corrupt;
+            break;
+        }
+        size_t count = 0;
+        while (true)
+        {
+            if (count == fields.size())
+            {
+                result = PersistReadResult::corrupt;
+                break;
+            }
+            auto tab = line.find('\t');
+            fields[count++] = line.substr(0, tab);
+            if (tab == std::string_view::npos)
+            {
+                break;
+            }
+            line.remove_prefix(tab + 1);
+        }
+        if (result == PersistReadResult::ok)
+        {
+            callback(PersistRecord(fields.data(), count));
+        }
+    }
+    if (std::ferror(file))
+    {
+        result = PersistReadResult::corrupt;
+    }
+    std::fclose(file);
+    return result;
+}
+
+PersistWriter::PersistWriter(const std::string& path, std::string_view schema,
+                             uint32_t version) :
+    path(path), tmpPath(path + "_tmp")
+{
+    file = std::fopen(tmpPath.c_str(), "we");
+    if (!file)
+    {
+        lg2::error("Failed to open {FILEPATH}: {ERRNO}", "FILEPATH", tmpPath,
+                   "ERRNO", errno);
+        return;
+    }
+    std::string header = persistHeader(schema, version) + "\n";
+    std::fputs(header.c_str(), file);
+}
+
+PersistWriter::~PersistWriter()
+{
+    if (file)
+    {
+        std::fclose(file);
+        std::remove(tmpPath.c_str());
+    }
+}
+
+void PersistWriter::record(std::initializer_list<std::string_view> fields)
+{
+    if (!file)
+    {
+        return;
+    }
+    bool first = true;
+    for (std::string_view field : fields)
+    {
+        if (!first)
+        {
+            std::fputc('\t', file);
+        }
+        first = false;
+        std::fwrite(field.data(), 1, field.size(), file);
+    }
+    std::fputc('\n', file);
+}
+
+bool PersistWriter::commit()
+{
+    if (!file)
+    {
+        return false;
+    }
+    bool failed = std::ferror(file) != 0;
+    failed |= std::fclose(file) != 0;
+    file = nullptr;
+    if (failed || std::rename(tmpPath.c_str(), path.c_str()) != 0)
+    {
+        lg2::error("Failed to write {FILEPATH}", "FILEPATH", path);
+        std::remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+std::string_view persistBool(bool value)
+{
+    return value ? "true" : "false";
+}
+
+std::optional<bool> parsePersistBool(std::string_view value)
+{
+    if (value == "true")
+    {
+        return true;
+    }
+    if (value == "false")
+    {
+        return false;
+    }
+    return std::nullopt;
+}
+
+bool forEachLegacyJsonValue(
+    const std::string& path,
+    const std::function<void(std::string_view name, std::string_view value)>&
+        callback)
+{
+    // A one time migration, so the file is simply read whole
+    std::ifstream file(path);
+    if (!file.good())
+    {
+        return false;
+    }
+    std::stringstream contents;
+    contents << file.rdbuf();
+    std::string text = contents.str();
+
+    std::string_view json(text);
+    std::string_view name;
+    size_t pos = 0;
+    while (pos < json.size())
+    {
+        char c = json[pos];
+        if (std::strchr(" \t\r\n{}[],", c))
+        {
+            pos++;
+            continue;
+        }
+        std::string_view token;
+        if (c == '"')
+        {
+            auto end = json.find_first_of("\"\\", pos + 1);
+            if (end == std::string_view::npos || json[end] == '\\')
+            {
+                return false;
+            }
+            token = json.substr(pos + 1, end - pos - 1);
+            pos = end + 1;
+        }
+        else
+        {
+            auto end = json.find_first_of(" \t\r\n{}[],:\"", pos);
+            if (end == pos)
+            {
+                return false;
+            }
+            token = json.substr(pos, end - pos);
+            pos = end;
+        }
+        auto next = json.find_first_not_of(" \t\r\n", pos);
+        if (c == '"' && next != std::string_view::npos && json[next] == ':')
+        {
+            name = token;
+            pos = next + 1;
+            continue;
+        }
+        callback(name, token);
+    }
+    return true;
+}
+
+} // namespace service
+} // namespace phosphor
@@ -0,0 +1,252 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "srvcfg_bulk.hpp"
+
+#include "alloc_accounting.hpp"
+
+#include <algorithm>
+
+extern phosphor::service::UnitRegistry srvMgrObjects;
+
+namespace phosphor
+{
+namespace service
+{
+
+static ServicesMap getServices()
+{
+    ServicesMap services;
+    for (const auto& [objPath, srvObj] : srvMgrObjects)
+    {
+        services.emplace(objPath, srvObj->getProperties());
+    }
+    return services;
+}
+
+static ServicesResultMap setServices(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    const ServicesMap& services)
+{
+    if (isUpdateInProgress())
+    {
+        lg2::error("SetServices rejected, apply in progress");
+        phosphor::logging::elog<
+            sdbusplus::xyz::openbmc_project::Common::Error::Unavailable>();
+    }
+
+    // Validate the whole batch first, so that it is staged all or nothing
+    ServicesResultMap results;
+    BatchPortClaims batchPorts;
+    bool valid = true;
+    for (const auto& [objPath, changes] : services)
+    {
+        auto it = srvMgrObjects.find(objPath.str);
+        if (it == srvMgrObjects.end())
+        {
+            results.emplace(objPath, "Unknown service");
+            valid = false;
+            continue;
+        }
+        std::string error =
+            it->second->checkPropertyChanges(changes, &batchPorts);
+        if (!error.empty())
+        {
+            valid = false;
+        }
+        results.emplace(objPath, std::move(error));
+    }
+    if (!valid)
+    {
+        lg2::error("SetServices rejected, invalid batch");
+        for (auto& [objPath, result] : results)
+        {
+            if (result.empty())
+            {
+                result = bulkResultAborted;
+            }
+        }
+        return results;
+    }
+
+    // Only a batch that changes something counts against the write limit
+    if (std::ranges::any_of(services, [](const auto& service) {
+            return srvMgrObjects.at(service.first.str)
+                ->hasPropertyChanges(service.second);
+        }))
+    {
+        admitBulkWrite();
+    }
+
+    bool applyRequired = false;
+    for (const auto& [objPath, changes] : services)
+    {
+        auto& srvObj = srvMgrObjects.at(objPath.str);
+        results[objPath] = srvObj->stagePropertyChanges(changes)
+                               ? bulkResultStaged
+                               : bulkResultUnchanged;
+        applyRequired |= (srvObj->updatedFlag != 0);
+    }
+    if (applyRequired)
+    {
+        // Skip the settle time; the whole batch is already staged and goes
+        // through a single stop/reload/restart cycle.
+        scheduleServiceApply(conn, std::chrono::seconds(0));
+    }
+    return results;
+}
+
+static PlanResult planServices(const ServicesMap& services)
+{
+    std::map<std::string, ServicePropertyMap> changes;
+    BatchPortClaims batchPorts;
+    for (const auto& [objPath, serviceChanges] : services)
+    {
+        auto it = srvMgrObjects.find(objPath.str);
+        if (it == srvMgrObjects.end())
+        {
+            lg2::error("Plan rejected, unknown service {OBJPATH}", "OBJPATH",
+                       objPath.str);
+            phosphor::logging::elog<sdbusplus::xyz::openbmc_project::Common::
+                                        Error::InvalidArgument>();
+        }
+        std::string error =
+            it->second->checkPropertyChanges(serviceChanges, &batchPorts);
+        if (!error.empty())
+        {
+            lg2::error("Plan rejected, {OBJPATH}: {ERROR}", "OBJPATH",
+                       objPath.str, "ERROR", error);
+            phosphor::logging::elog<sdbusplus::xyz::openbmc_project::Common::
+                                        Error::InvalidArgument>();
+        }
+        changes.emplace(objPath.str, serviceChanges);
+    }
+
+    ApplyPlan plan = buildApplyPlan(changes);
+    PlanCalls calls;
+    for (auto& call : plan.calls)
+    {
+        calls.emplace_back(std::move(call.method), std::move(call.units),
+                           call.estimate.count());
+    }
+    PlanDropIns dropIns;
+    for (auto& dropIn : plan.dropIns)
+    {
+        dropIns.emplace_back(std::move(dropIn.path),
+                             std::move(dropIn.contents));
+    }
+    return {std::move(calls), std::move(dropIns), plan.daemonReload,
+            plan.estimate.count()};
+}
+
+static std::vector<HistoryEntry> getApplyHistoryEntries()
+{
+    std::vector<HistoryEntry> entries;
+    for (const ApplyRecord* record : getApplyHistory())
+    {
+        HistoryObjects objects;
+        for (const auto& object : record->objects)
+        {
+            objects.emplace_back(object.objPath,
+                                 updatedPropNames(object.updatedFlag),
+                                 object.units,
+                                 applyOutcomeName(object.outcome),
+                                 object.rolledBack);
+        }
+        HistoryCalls calls;
+        for (const auto& call : record->calls)
+        {
+            calls.emplace_back(call.method, call.units, call.duration.count(),
+                               call.result);
+        }
+        entries.emplace_back(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                record->start.time_since_epoch())
+                .count(),
+            applyOutcomeName(record->outcome), record->stopDuration.count(),
+            record->reloadDuration.count(), record->restartDuration.count(),
+            std::move(objects), std::move(calls));
+    }
+    return entries;
+}
+
+#ifdef ALLOC_ACCOUNTING
+static AllocationStatsMap getAllocationStats()
+{
+    AllocationStatsMap result;
+    AllocStatsArray stats = getAllocStats();
+    for (size_t i = 0; i < stats.size(); i++)
+    {
+        result.emplace(allocSubsystemName(static_cast<AllocSubsystem>(i)),
+                       std::make_tuple(stats[i].liveBytes, stats[i].peakBytes,
+                                       stats[i].allocations,
+                                       stats[i].liveAllocations));
+    }
+    return result;
+}
+#endif
+
+std::shared_ptr<sdbusplus::asio::dbus_interface> registerBulkInterface(
+    sdbusplus::asio::object_server& server,
+    const std::shared_ptr<sdbusplus::asio::connection>& conn)
+{
+    AllocScope allocScope(AllocSubsystem::objectServer);
+    auto iface =
+        server.add_interface(srcCfgMgrBasePath, serviceConfigMgrIntfName);
+    iface->register_method("GetServices", []() { return getServices(); });
+    iface->register_property_r(
+        "ThrottledWrites", uint64_t{0}, sdbusplus::vtable::property_::none,
+        [](const uint64_t&) { return getWriteStatistics().throttled; });
+    iface->register_property_r(
+        "CoalescedWrites", uint64_t{0}, sdbusplus::vtable::property_::none,
+        [](const uint64_t&) { return getWriteStatistics().coalesced; });
+    iface->register_method("SetServices", [conn](const ServicesMap& services) {
+        return setServices(conn, services);
+    });
+    iface->register_method("Plan", [](const ServicesMap& services) {
+        return planServices(services);
+    });
+    iface->register_method("GetApplyHistory",
+                           []() { return getApplyHistoryEntries(); });
+    iface->register_signal<std::string, std::vector<sdbusplus::object_path>>(
+        applyCompletedSignal);
+#ifdef ALLOC_ACCOUNTING
+    iface->register_method("GetAllocationStats",
+                           []() { return getAllocationStats(); });
+#endif
+    iface->initialize();
+
+    setApplyCompletedHandler(
+        [weakIface = std::weak_ptr(iface)](const ApplyRecord& record) {
+            auto iface = weakIface.lock();
+            if (!iface)
+            {
+                return;
+            }
+            std::vector<sdbusplus::object_path> objects;
+            for (const auto& object : record.objects)
+            {
+                objects.emplace_back(object.objPath);
+            }
+            auto signal = iface->new_signal(applyCompletedSignal);
+            signal.append(std::string(applyOutcomeName(record.outcome)),
+                          objects);
+            signal.signal_send();
+        });
+    return iface;
+}
+
+} // namespace service
+} // namespace phosphor
@@ -15,25 +15,35 @@
 */
 #include "srvcfg_manager.hpp"
 
-#include <boost/asio/detached.hpp>
-#include <boost/asio/spawn.hpp>
-#ifdef USB_CODE_UPDATE
-#include <cereal/archives/json.hpp>
-#include <cereal/types/tuple.hpp>
-#include <cereal/types/unordered_map.hpp>
+#include "alloc_accounting.hpp"
+#include "persist_codec.hpp"
+#include "startup_profiler.hpp"
 
+#include <boost/asio/co_spawn.hpp>
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#ifdef USB_CODE_UPDATE
+#include <charconv>
 #include <cstdio>
 #endif
 #include <fstream>
-#ifdef PERSIST_SETTINGS
-#include <nlohmann/json.hpp>
-#endif
 #include <regex>
+#include <set>
+#include <unordered_map>
 
 extern std::unique_ptr<boost::asio::steady_timer> timer;
-extern std::map<std::string, std::shared_ptr<phosphor::service::ServiceConfig>>
-    srvMgrObjects;
+extern phosphor::service::UnitRegistry srvMgrObjects;
 static bool updateInProgress = false;
+static bool applyPending = false;
+// Work held back until the running apply cycle ends
+static std::vector<std::function<void()>> afterApplyCycle;
+static bool dryRun = false;
+// Objects with staged changes, by object path so that they are applied in the
+// same order as srvMgrObjects. Apply cycles drain it instead of visiting every
+// managed object.
+static std::set<std::string> dirtyObjects;
+static std::function<void(const phosphor::service::ApplyRecord&)>
+    applyCompletedHandler;
 
 namespace phosphor
 {
@@ -42,13 +52,50 @@ namespace service
 
 static constexpr const char* overrideConfFileName = "override.conf";
 static constexpr const size_t restartTimeout = 15; // seconds
+// How long a socket keeps accepting on its previous port after a port
+// migration, see ServiceConfig::canMigratePort()
+static constexpr const auto portRetireDelay = std::chrono::seconds(60);
+
+// Client write budgets: a short burst, then a steady rate, per object and for
+// the daemon as a whole. Real configuration changes are rare, so these only
+// bite on a misbehaving client.
+static constexpr const double objectWriteBurst = 5;
+static constexpr const double objectWritesPerSec = 1;
+static constexpr const double globalWriteBurst = 20;
+static constexpr const double globalWritesPerSec = 5;
+
+static TokenBucket globalWriteLimiter(globalWriteBurst, globalWritesPerSec);
+static WriteStatistics writeStatistics;
+
+// Apply history: the last cycles in a ring, with a cap on the systemd calls
+// kept per cycle, so that its size doesn't depend on how busy we are
+static constexpr const size_t applyHistorySize = 16;
+static constexpr const size_t applyHistoryMaxCalls = 64;
+// Apply cycles kept in the StopTimes and StartTimes of each object
+static constexpr const size_t unitJobTimesHistorySize = 8;
+static std::array<ApplyRecord, applyHistorySize> applyHistory;
+static size_t applyHistoryNext = 0;
+static size_t applyHistoryCount = 0;
+// Record of the running cycle, only added to the history once it is over so
+// that the history never holds a partial one. Its buffers are swapped with
+// the oldest entry's, which keeps reusing them.
+static ApplyRecord cycleRecord;
+
+// Listen and staged ports of every managed socket, keyed by protocol and
+// port, so that a new port is checked without walking all objects
+static std::unordered_multimap<uint32_t, const ServiceConfig*> portIndex;
 
-static constexpr const char* systemdOverrideUnitBasePath =
-    "/etc/systemd/system/";
+static uint32_t portIndexKey(SocketProtocol protocol, uint16_t port)
+{
+    return (static_cast<uint32_t>(protocol) << 16) | port;
+}
 
 #ifdef PERSIST_SETTINGS
 static constexpr const char* persistDataFileVersionStr = "Version";
 static constexpr const size_t persistDataFileVersion = 1;
+static constexpr const char* stateFileSchema = "unit-state";
+// Version 1 was the JSON format, migrated when found
+static constexpr const uint32_t stateFileVersion = 2;
 #endif
 
 #ifdef USB_CODE_UPDATE
@@ -59,7 +106,13 @@ static constexpr const char* usbCodeUpdateStateFile =
 static constexpr const char* emptyUsbCodeUpdateRulesFile =
     "/etc/udev/rules.d/70-bmc-usb.rules";
 
-using UsbCodeUpdateStateMap = std::unordered_map<std::string, bool>;
+// Toggles within this time are written out once
+static constexpr const auto usbCodeUpdateWriteDelay =
+    std::chrono::milliseconds(500);
+
+static constexpr const char* usbCodeUpdateSchema = "usb-code-update-state";
+// Version 1 was the cereal JSON format, migrated when found
+static constexpr const uint32_t usbCodeUpdateVersion = 2;
 
 void ServiceConfig::setUSBCodeUpdateState(const bool& state)
 {
@@ -93,574 +146,2062 @@ void ServiceConfig::setUSBCodeUpdateState(const bool& state)
 void ServiceConfig::saveUSBCodeUpdateStateToFile(const bool& maskedState,
                                                  const bool& enabledState)
 {
+    AllocScope allocScope(AllocSubsystem::persistence);
     if (!std::filesystem::exists(usbCodeUpdateStateFilePath))
     {
         std::filesystem::create_directories(usbCodeUpdateStateFilePath);
     }
 
-    UsbCodeUpdateStateMap usbCodeUpdateState;
-    usbCodeUpdateState[srvCfgPropMasked] = maskedState;
-    usbCodeUpdateState[srvCfgPropEnabled] = enabledState;
-
-    std::ofstream file(usbCodeUpdateStateFile, std::ios::out);
-    cereal::JSONOutputArchive archive(file);
-    archive(CEREAL_NVP(usbCodeUpdateState));
+    PersistWriter writer(usbCodeUpdateStateFile, usbCodeUpdateSchema,
+                         usbCodeUpdateVersion);
+    writer.record({srvCfgPropMasked, persistBool(maskedState)});
+    writer.record({srvCfgPropEnabled, persistBool(enabledState)});
+    writer.commit();
 }
 
 void ServiceConfig::getUSBCodeUpdateStateFromFile()
 {
-    if (!std::filesystem::exists(usbCodeUpdateStateFile))
+    AllocScope allocScope(AllocSubsystem::persistence);
+    std::optional<bool> masked;
+    std::optional<bool> enabled;
+    auto setState = [&masked, &enabled](std::string_view name,
+                                        std::string_view value) {
+        if (name == srvCfgPropMasked)
+        {
+            masked = parsePersistBool(value);
+        }
+        else if (name == srvCfgPropEnabled)
+        {
+            enabled = parsePersistBool(value);
+        }
+    };
+    auto result = readPersistFile(
+        usbCodeUpdateStateFile, usbCodeUpdateSchema, usbCodeUpdateVersion,
+        [&setState](PersistRecord record) {
+            if (record.size() == 2)
+            {
+                setState(record[0], record[1]);
+            }
+        });
+    bool migrated = false;
+    if (result == PersistReadResult::otherFormat)
+    {
+        // Written by cereal as a list of key/value members
+        std::string_view key;
+        migrated = forEachLegacyJsonValue(
+            usbCodeUpdateStateFile,
+            [&key, &setState](std::string_view name, std::string_view value) {
+                if (name == "key")
+                {
+                    key = value;
+                }
+                else if (name == "value")
+                {
+                    setState(key, value);
+                }
+            });
+    }
+    if (result == PersistReadResult::missing)
     {
         lg2::info("usb-code-update-state file does not exist");
+    }
+    else if (result != PersistReadResult::ok && !migrated)
+    {
+        lg2::error("Failed to load {FILEPATH}, using the defaults", "FILEPATH",
+                   usbCodeUpdateStateFile);
+    }
+
+    UsbCodeUpdateState state;
+    if (masked)
+    {
+        state.masked = *masked;
+        state.enabled = !state.masked && enabled.value_or(state.enabled);
+    }
+    usbCodeUpdateState = state;
+    if (result == PersistReadResult::ok)
+    {
+        // The file is up to date, only the rules may need writing
+        usbCodeUpdateWritten = state;
+    }
+}
+
+void ServiceConfig::queueUSBCodeUpdateWrite()
+{
+    usbCodeUpdateState = UsbCodeUpdateState{unitMaskedState, unitEnabledState};
+    if (usbCodeUpdateWriteQueued)
+    {
+        return;
+    }
+    // The files are written outside of the D-Bus handler, once for a burst
+    // of toggles
+    usbCodeUpdateWriteQueued = true;
+    if (!usbCodeUpdateTimer)
+    {
+        usbCodeUpdateTimer =
+            std::make_unique<boost::asio::steady_timer>(conn->get_io_context());
+    }
+    usbCodeUpdateTimer->expires_after(usbCodeUpdateWriteDelay);
+    usbCodeUpdateTimer->async_wait([handle = handle](
+                                       const boost::system::error_code& ec) {
+        auto srvObj = srvMgrObjects.get(handle);
+        if (ec == boost::asio::error::operation_aborted || !srvObj)
+        {
+            // The object is gone
+            return;
+        }
+        srvObj->usbCodeUpdateWriteQueued = false;
+        if (ec)
+        {
+            lg2::error("async wait error: {EC}", "EC", ec.value());
+            return;
+        }
+        try
+        {
+            srvObj->writeUSBCodeUpdateState();
+        }
+        catch (const std::exception& e)
+        {
+            lg2::error("Failed to write the USB code update state: {ERROR}",
+                       "ERROR", e);
+        }
+    });
+}
+
+void ServiceConfig::writeUSBCodeUpdateState()
+{
+    if (!usbCodeUpdateState || dryRun)
+    {
+        return;
+    }
+    const UsbCodeUpdateState& state = *usbCodeUpdateState;
+    if (!usbCodeUpdateRulesWritten ||
+        *usbCodeUpdateRulesWritten != state.enabled)
+    {
+        setUSBCodeUpdateState(state.enabled);
+        usbCodeUpdateRulesWritten = state.enabled;
+    }
+    if (usbCodeUpdateWritten != state)
+    {
+        saveUSBCodeUpdateStateToFile(state.masked, state.enabled);
+        usbCodeUpdateWritten = state;
+    }
+}
+#endif
+
+void ServiceConfig::updateSocketProperties(const ListenAddress& listen)
+{
+    protocol = listen.protocol;
+    portNum = listen.port;
+    listenPort = listen.port;
+    claimPorts();
+    if (sockAttrIface && sockAttrIface->is_initialized())
+    {
+        internalSet = true;
+        sockAttrIface->set_property(sockAttrPropPort, portNum);
+        internalSet = false;
+    }
+}
 
-        unitMaskedState = false;
-        unitEnabledState = true;
+void ServiceConfig::updateServiceProperties(UnitFileState fileState,
+                                            UnitSubState subState)
+{
+    unitFileState = fileState;
+    unitMaskedState = (unitFileState == UnitFileState::masked);
+    unitEnabledState = (unitFileState == UnitFileState::enabled);
+    unitSubState = subState;
+    if (unitSubState != UnitSubState::other)
+    {
         unitRunningState = true;
-        setUSBCodeUpdateState(unitEnabledState);
+    }
+#ifdef USB_CODE_UPDATE
+    if (baseUnitName == usbCodeUpdateUnitName)
+    {
+        // The pseudo unit's own state overrides what systemd reports
+        if (!usbCodeUpdateState)
+        {
+            getUSBCodeUpdateStateFromFile();
+        }
+        unitMaskedState = usbCodeUpdateState->masked;
+        unitEnabledState = usbCodeUpdateState->enabled;
+        unitRunningState = usbCodeUpdateState->enabled;
+        if (!usbCodeUpdateRulesWritten)
+        {
+            // Put the udev rules in line with the state on startup
+            queueUSBCodeUpdateWrite();
+        }
+    }
+#endif
+    if (srvCfgIface && srvCfgIface->is_initialized())
+    {
+        internalSet = true;
+        srvCfgIface->set_property(srvCfgPropMasked, unitMaskedState);
+        srvCfgIface->set_property(srvCfgPropEnabled, unitEnabledState);
+        srvCfgIface->set_property(srvCfgPropRunning, unitRunningState);
+        internalSet = false;
+    }
+}
+
+// Results of the property reads of a single refresh. Only the properties we
+// act on are read, each with its own Get, and all of them are in flight at
+// once instead of chaining GetAll on the (large) Unit and Socket interfaces.
+struct UnitPropertyFetch
+{
+    UnitFileState unitFileState = UnitFileState::other;
+    UnitSubState unitSubState = UnitSubState::other;
+    std::optional<ListenAddress> listen;
+    size_t pending = 0;
+    bool failed = false;
+};
+
+template <typename Decoder, typename Handler>
+static void getUnitProperty(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    const std::string& path, const char* intf, const char* property,
+    const std::shared_ptr<UnitPropertyFetch>& fetch, Decoder&& decode,
+    const Handler& handler)
+{
+    conn->async_method_call(
+        [fetch, property, decode = std::forward<Decoder>(decode),
+         handler](boost::system::error_code ec, sdbusplus::message_t& msg) {
+            if (ec)
+            {
+                lg2::error(
+                    "async_method_call error: Failed to get {PROPERTY}: {EC}",
+                    "PROPERTY", property, "EC", ec.value());
+                fetch->failed = true;
+            }
+            else
+            {
+                try
+                {
+                    decode(msg);
+                }
+                catch (const std::exception& e)
+                {
+                    lg2::error("Exception in decoding {PROPERTY}: {ERROR}",
+                               "PROPERTY", property, "ERROR", e);
+                    fetch->failed = true;
+                }
+            }
+            handler();
+        },
+        sysdService, path, dBusPropIntf, dBusGetMethod, intf, property);
+}
+
+void ServiceConfig::applyFetchedProperties(const UnitPropertyFetch& fetch,
+                                           bool isRestore)
+{
+    try
+    {
+        updateServiceProperties(fetch.unitFileState, fetch.unitSubState);
+        if (fetch.listen)
+        {
+            updateSocketProperties(*fetch.listen);
+            if (isRestore)
+            {
+                resumePortRetirement();
+            }
+        }
+        if (!srvCfgIface)
+        {
+            registerProperties();
+        }
+        if (isRestore)
+        {
+            // On startup or when notified of a persistent data change,
+            // load our persistent settings and compare to
+            // what was read from systemd. If they are different, use
+            // the persistent settings
+            loadStateFile();
+        }
+        else
+        {
+            // This is just an update once we're already running so
+            // write the values out to our persistent settings
+            writeStateFile();
+        }
+    }
+    catch (const std::exception& e)
+    {
+        lg2::error("Exception in updating unit properties: {ERROR}", "ERROR",
+                   e);
+    }
+}
+
+std::string ServiceConfig::getStateObjectPath() const
+{
+    return isSocketActivatedService ? getSocketObjectPath()
+                                    : getServiceObjectPath();
+}
+
+std::string ServiceConfig::getStateUnitName() const
+{
+    return isSocketActivatedService ? getSocketUnitName()
+                                    : getServiceUnitName();
+}
+
+template <typename Handler>
+void ServiceConfig::fetchUnitFileStateAndListen(
+    const std::shared_ptr<UnitPropertyFetch>& fetch, const Handler& handler)
+{
+    getUnitProperty(conn, getStateObjectPath(), sysdUnitIntf, "UnitFileState",
+                    fetch,
+                    [fetch](sdbusplus::message_t& msg) {
+                        fetch->unitFileState =
+                            toUnitFileState(readStringProperty(msg));
+                    },
+                    handler);
+    if (hasSocketUnit)
+    {
+        getUnitProperty(conn, getSocketObjectPath(), sysdSocketIntf, "Listen",
+                        fetch,
+                        [fetch](sdbusplus::message_t& msg) {
+                            fetch->listen = readListenProperty(msg);
+                        },
+                        handler);
+    }
+}
+
+void ServiceConfig::queryAndUpdateProperties(bool isRestore = false)
+{
+    std::string objectPath = getStateObjectPath();
+    if (objectPath.empty())
+    {
+        reportStartupPublished();
         return;
     }
 
-    std::ifstream file(usbCodeUpdateStateFile);
-    cereal::JSONInputArchive archive(file);
-    UsbCodeUpdateStateMap usbCodeUpdateState;
-    archive(usbCodeUpdateState);
+    auto fetch = std::make_shared<UnitPropertyFetch>();
+    fetch->pending = hasSocketUnit ? 3 : 2;
+    auto handler = [handle = handle, fetch, isRestore]() {
+        if (--fetch->pending != 0)
+        {
+            return;
+        }
+        auto srvObj = srvMgrObjects.get(handle);
+        if (!srvObj)
+        {
+            // Retired while the query was in flight
+            return;
+        }
+        if (!fetch->failed)
+        {
+            srvObj->applyFetchedProperties(*fetch, isRestore);
+        }
+        srvObj->reportStartupPublished();
+    };
+
+    fetchUnitFileStateAndListen(fetch, handler);
+    getUnitProperty(conn, objectPath, sysdUnitIntf, "SubState", fetch,
+                    [fetch](sdbusplus::message_t& msg) {
+                        fetch->unitSubState =
+                            toUnitSubState(readStringProperty(msg));
+                    },
+                    handler);
+}
+
+// Shared state of refreshProperties(), with a fetch per object
+struct PropertyRefresh
+{
+    std::vector<std::shared_ptr<ServiceConfig>> objects;
+    std::vector<std::shared_ptr<UnitPropertyFetch>> fetched;
+    size_t pending = 0;
+    std::function<void()> done;
+};
 
-    auto iterMask = usbCodeUpdateState.find(srvCfgPropMasked);
-    if (iterMask != usbCodeUpdateState.end())
+void ServiceConfig::refreshProperties(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    std::vector<std::shared_ptr<ServiceConfig>> objects,
+    std::function<void()> done)
+{
+    auto refresh = std::make_shared<PropertyRefresh>();
+    refresh->done = std::move(done);
+    std::vector<std::string> unitNames;
+    for (auto& srvObj : objects)
     {
-        unitMaskedState = iterMask->second;
-        if (unitMaskedState)
+        if (!srvObj->getStateObjectPath().empty())
+        {
+            unitNames.push_back(srvObj->getStateUnitName());
+            refresh->objects.push_back(std::move(srvObj));
+            refresh->fetched.push_back(std::make_shared<UnitPropertyFetch>());
+        }
+    }
+    if (refresh->objects.empty())
+    {
+        if (refresh->done)
+        {
+            boost::asio::post(conn->get_io_context(), refresh->done);
+        }
+        return;
+    }
+
+    // Everything is sent at once and applied in one pass when the last
+    // reply is in
+    auto handler = [refresh]() {
+        if (--refresh->pending != 0)
         {
-            unitEnabledState = !unitMaskedState;
-            unitRunningState = !unitMaskedState;
-            setUSBCodeUpdateState(unitEnabledState);
             return;
         }
+        for (size_t i = 0; i < refresh->objects.size(); i++)
+        {
+            if (!refresh->fetched[i]->failed)
+            {
+                refresh->objects[i]->applyFetchedProperties(
+                    *refresh->fetched[i], false);
+            }
+        }
+        if (refresh->done)
+        {
+            refresh->done();
+        }
+    };
+
+    // One ListUnitsByNames for the sub states of all the units
+    refresh->pending = 1;
+    conn->async_method_call(
+        [refresh, handler](boost::system::error_code ec,
+                           sdbusplus::message_t& msg) {
+            try
+            {
+                checkAndThrowInternalFailure(
+                    ec, "async_method_call error: ListUnitsByNames failed");
+                std::unordered_map<std::string, size_t> index;
+                for (size_t i = 0; i < refresh->objects.size(); i++)
+                {
+                    index.emplace(refresh->objects[i]->getStateUnitName(), i);
+                }
+                forEachListedUnit(msg, [&](const ListedUnit& unit) {
+                    auto it = index.find(std::string(unit.name));
+                    if (it != index.end())
+                    {
+                        refresh->fetched[it->second]->unitSubState =
+                            toUnitSubState(unit.subState);
+                    }
+                });
+            }
+            catch (const std::exception& e)
+            {
+                lg2::error("Failed to refresh unit sub states: {ERROR}",
+                           "ERROR", e);
+                for (auto& fetch : refresh->fetched)
+                {
+                    fetch->failed = true;
+                }
+            }
+            handler();
+        },
+        sysdService, sysdObjPath, sysdMgrIntf, "ListUnitsByNames", unitNames);
+
+    // Pipelined with the unit file states and socket addresses
+    for (size_t i = 0; i < refresh->objects.size(); i++)
+    {
+        refresh->pending += refresh->objects[i]->hasSocketUnit ? 2 : 1;
+        refresh->objects[i]->fetchUnitFileStateAndListen(refresh->fetched[i],
+                                                         handler);
+    }
+}
+
+boost::asio::awaitable<void> ServiceConfig::awaitRefreshProperties(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    std::vector<std::shared_ptr<ServiceConfig>> objects)
+{
+    co_await boost::asio::async_initiate<
+        const boost::asio::use_awaitable_t<>, void()>(
+        [&conn, &objects](auto handler) {
+            // The handler is move only, and std::function needs a copy
+            auto shared =
+                std::make_shared<decltype(handler)>(std::move(handler));
+            refreshProperties(conn, std::move(objects),
+                              [shared]() { std::move(*shared)(); });
+        },
+        boost::asio::use_awaitable);
+}
+
+void ServiceConfig::createSocketOverrideConf()
+{
+    if (hasSocketUnit)
+    {
+        /// Check override socket directory exist, if not create it.
+        std::filesystem::path ovrUnitFileDir(getOverrideConfDir());
+        if (!std::filesystem::exists(ovrUnitFileDir))
+        {
+            if (!std::filesystem::create_directories(ovrUnitFileDir))
+            {
+                lg2::error("Unable to create the {DIR} directory.", "DIR",
+                           ovrUnitFileDir);
+                phosphor::logging::elog<sdbusplus::xyz::openbmc_project::
+                                            Common::Error::InternalFailure>();
+            }
+        }
+    }
+}
+
+void ServiceConfig::writeStateFile()
+{
+    AllocScope allocScope(AllocSubsystem::persistence);
+#ifdef PERSIST_SETTINGS
+    if (dryRun)
+    {
+        // The persisted settings are kept for a real run
+        return;
+    }
+    std::string stateFile = getStateFile();
+    lg2::debug("Writing Persistent State File Information to {STATE_FILE}",
+               "STATE_FILE", stateFile);
+    PersistWriter writer(stateFile, stateFileSchema, stateFileVersion);
+    writer.record({srvCfgPropMasked, persistBool(unitMaskedState)});
+    writer.record({srvCfgPropEnabled, persistBool(unitEnabledState)});
+    writer.record({srvCfgPropRunning, persistBool(unitRunningState)});
+    writer.commit();
+#endif
+}
+
+#ifdef PERSIST_SETTINGS
+// Persisted unit state, each missing until read
+struct PersistedUnitState
+{
+    std::optional<bool> masked;
+    std::optional<bool> enabled;
+    std::optional<bool> running;
+
+    void set(std::string_view name, std::string_view value)
+    {
+        if (name == srvCfgPropMasked)
+        {
+            masked = parsePersistBool(value);
+        }
+        else if (name == srvCfgPropEnabled)
+        {
+            enabled = parsePersistBool(value);
+        }
+        else if (name == srvCfgPropRunning)
+        {
+            running = parsePersistBool(value);
+        }
+    }
+
+    bool complete() const
+    {
+        return masked && enabled && running;
+    }
+};
+
+// Read a state file of the JSON format of version 1
+static bool readLegacyStateFile(const std::string& stateFile,
+                                PersistedUnitState& state)
+{
+    bool versionMatch = false;
+    bool parsed = forEachLegacyJsonValue(
+        stateFile, [&](std::string_view name, std::string_view value) {
+            if (name == persistDataFileVersionStr)
+            {
+                versionMatch =
+                    (value == std::to_string(persistDataFileVersion));
+            }
+            state.set(name, value);
+        });
+    return parsed && versionMatch;
+}
+#endif
 
-        auto iterEnable = usbCodeUpdateState.find(srvCfgPropEnabled);
-        if (iterEnable != usbCodeUpdateState.end())
+void ServiceConfig::loadStateFile()
+{
+    AllocScope allocScope(AllocSubsystem::persistence);
+    StartupPhaseTimer phaseTimer(StartupPhase::stateFiles);
+#ifdef PERSIST_SETTINGS
+    std::string stateFile = getStateFile();
+    lg2::debug("Loading Persistent State File Information from {STATE_FILE}",
+               "STATE_FILE", stateFile);
+    PersistedUnitState state;
+    auto result = readPersistFile(
+        stateFile, stateFileSchema, stateFileVersion,
+        [&state](PersistRecord record) {
+            if (record.size() == 2)
+            {
+                state.set(record[0], record[1]);
+            }
+        });
+    if (result == PersistReadResult::missing)
+    {
+        // Just write out what we got from systemd if no existing config file
+        writeStateFile();
+        return;
+    }
+    bool migrated = false;
+    if (result == PersistReadResult::otherFormat)
+    {
+        migrated = readLegacyStateFile(stateFile, state);
+        if (migrated)
         {
-            unitEnabledState = iterEnable->second;
-            unitRunningState = iterEnable->second;
-            setUSBCodeUpdateState(unitEnabledState);
+            lg2::info("Migrating {FILEPATH} from version {VERSION}",
+                      "FILEPATH", stateFile, "VERSION",
+                      persistDataFileVersion);
         }
     }
+    if ((result != PersistReadResult::ok && !migrated) || !state.complete())
+    {
+        lg2::error("Error loading {FILEPATH}; delete it and continue",
+                   "FILEPATH", stateFile);
+        std::filesystem::remove(stateFile);
+        // rewrite file with what was ready from systemd
+        writeStateFile();
+        return;
+    }
+
+    // If there are any differences, the persistent config file wins so
+    // update the dbus properties and trigger a reload to apply the changes
+    if (*state.masked != unitMaskedState)
+    {
+        lg2::info(
+            "Masked property for {FILEPATH} not equal. Setting to {SETTING}",
+            "FILEPATH", stateFile, "SETTING", *state.masked);
+        unitMaskedState = *state.masked;
+        updatedFlag |= (1 << static_cast<uint8_t>(UpdatedProp::maskedState));
+        startServiceRestartTimer();
+    }
+    if (*state.enabled != unitEnabledState)
+    {
+        lg2::info(
+            "Enabled property for {FILEPATH} not equal. Setting to {SETTING}",
+            "FILEPATH", stateFile, "SETTING", *state.enabled);
+        unitEnabledState = *state.enabled;
+        updatedFlag |= (1 << static_cast<uint8_t>(UpdatedProp::enabledState));
+        startServiceRestartTimer();
+    }
+    if (*state.running != unitRunningState)
+    {
+        lg2::info(
+            "Running property for {FILEPATH} not equal. Setting to {SETTING}",
+            "FILEPATH", stateFile, "SETTING", *state.running);
+        unitRunningState = *state.running;
+        updatedFlag |= (1 << static_cast<uint8_t>(UpdatedProp::runningState));
+        startServiceRestartTimer();
+    }
+    if (migrated)
+    {
+        // The properties now hold the persisted state
+        writeStateFile();
+    }
+#endif
+}
+
+void ServiceConfig::reportStartupPublished()
+{
+    // Only the first query counts, whether or not it succeeded
+    if (startupPending)
+    {
+        startupPending = false;
+        startupObjectPublished();
+    }
+}
+
+void ServiceConfig::reloadServiceConfig()
+{
+    queryAndUpdateProperties(true);
+}
+
+ServiceConfig::ServiceConfig(
+    sdbusplus::asio::object_server& srv_,
+    std::shared_ptr<sdbusplus::asio::connection>& conn_,
+    const std::string& objPath_, const std::string& baseUnitName_,
+    const std::string& instanceName_, bool hasServiceUnit_,
+    bool hasSocketUnit_) :
+    conn(conn_), server(srv_),
+    writeLimiter(objectWriteBurst, objectWritesPerSec), objPath(objPath_),
+    baseUnitName(internString(baseUnitName_)), instanceName(instanceName_),
+    hasServiceUnit(hasServiceUnit_), hasSocketUnit(hasSocketUnit_)
+{
+    isSocketActivatedService = !hasServiceUnit;
+    updatedFlag = 0;
+    return;
+}
+
+ServiceConfig::~ServiceConfig()
+{
+    listenPort = 0;
+    portNum = 0;
+    retiringPort = 0;
+    claimPorts();
+}
+
+std::string ServiceConfig::getInstantiatedUnitName() const
+{
+    return std::string(baseUnitName) + addInstanceName(instanceName, "@");
+}
+
+std::string ServiceConfig::getSocketUnitName() const
+{
+    return getInstantiatedUnitName() + ".socket";
+}
+
+std::string ServiceConfig::getServiceUnitName() const
+{
+    return getInstantiatedUnitName() + ".service";
+}
+
+std::string ServiceConfig::getSocketObjectPath() const
+{
+    return hasSocketUnit ? systemdUnitObjectPath(getSocketUnitName()) : "";
+}
+
+std::string ServiceConfig::getServiceObjectPath() const
+{
+    if (!hasServiceUnit)
+    {
+        return "";
+    }
+#ifdef USB_CODE_UPDATE
+    if (baseUnitName == usbCodeUpdateUnitName)
+    {
+        return usbCodeUpdateServiceObjPath;
+    }
+#endif
+    return systemdUnitObjectPath(getServiceUnitName());
+}
+
+std::vector<std::string> ServiceConfig::getUnitFileNames() const
+{
+    std::vector<std::string> names;
+    if (hasSocketUnit)
+    {
+        names.push_back(getSocketUnitName());
+    }
+    if (hasServiceUnit)
+    {
+        names.push_back(getServiceUnitName());
+    }
+    return names;
+}
+
+std::string ServiceConfig::getOverrideConfDir() const
+{
+    return systemdOverrideUnitBasePath + getSocketUnitName() + ".d";
+}
+
+std::string ServiceConfig::getStateFile() const
+{
+    return srvDataBaseDir + getInstantiatedUnitName();
+}
+
+bool ServiceConfig::isMaskedOut()
+{
+    // return true  if state is masked & no request to update the maskedState
+    return (
+        unitFileState == UnitFileState::masked &&
+        !(updatedFlag & (1 << static_cast<uint8_t>(UpdatedProp::maskedState))));
+}
+
+std::string ServiceConfig::getSocketOverrideConf(uint16_t extraPort) const
+{
+    // The empty Listen resets the list inherited from the socket unit. The
+    // new port comes first, as the first entry is the one read back as Port.
+    std::string listen = std::string("Listen") + socketProtocolName(protocol);
+    std::string conf = "[Socket]\n" + listen + "=\n" + listen + "=" +
+                       std::to_string(portNum) + "\n";
+    if (extraPort)
+    {
+        conf += listen + "=" + std::to_string(extraPort) + "\n";
+    }
+    return conf;
+}
+
+bool ServiceConfig::canMigratePort() const
+{
+    // A socket activated service only moving to another port is moved
+    // without downtime: the socket listens on both ports for a while before
+    // the previous one is dropped, and running connection instances are
+    // left to finish on their own.
+    return isSocketActivatedService && hasSocketUnit &&
+           updatedFlag == (1 << static_cast<uint8_t>(UpdatedProp::port)) &&
+           unitSubState == UnitSubState::listening && unitRunningState;
+}
+
+void ServiceConfig::schedulePortRetirement()
+{
+    if (!portRetireTimer)
+    {
+        portRetireTimer =
+            std::make_unique<boost::asio::steady_timer>(conn->get_io_context());
+    }
+    portRetireTimer->expires_after(portRetireDelay);
+    portRetireTimer->async_wait([handle = handle](
+                                    const boost::system::error_code& ec) {
+        if (ec == boost::asio::error::operation_aborted)
+        {
+            // Timer reset, or the object is gone
+            return;
+        }
+        auto srvObj = srvMgrObjects.get(handle);
+        if (ec || !srvObj || !srvObj->retiringPort)
+        {
+            return;
+        }
+        // Staging in the middle of a cycle would change the object under it,
+        // and the object may be removed before the cycle ends
+        runAfterApplyCycle([handle]() {
+            auto srvObj = srvMgrObjects.get(handle);
+            if (!srvObj || !srvObj->retiringPort)
+            {
+                return;
+            }
+            lg2::info("Dropping previous port {PORT} of {OBJPATH}", "PORT",
+                      srvObj->retiringPort, "OBJPATH", srvObj->objPath);
+            // Re-applying the port now plans a drop-in with the new port
+            // alone
+            srvObj->updatedFlag |=
+                (1 << static_cast<uint8_t>(UpdatedProp::port));
+            srvObj->markDirty();
+            scheduleServiceApply(srvObj->conn, std::chrono::seconds(0));
+        });
+    });
+}
+
+void ServiceConfig::resumePortRetirement()
+{
+    if (retiringPort)
+    {
+        return;
+    }
+    // A migration cut short by a restart leaves the previous port second in
+    // our drop-in. It must not stay open for good.
+    std::ifstream cfgFile(getOverrideConfDir() + "/" + overrideConfFileName);
+    std::string listen = std::string("Listen") + socketProtocolName(protocol) +
+                         "=";
+    std::string line;
+    size_t entries = 0;
+    while (std::getline(cfgFile, line))
+    {
+        if (!line.starts_with(listen) || line.size() == listen.size())
+        {
+            continue;
+        }
+        if (++entries != 2)
+        {
+            continue;
+        }
+        uint16_t port = 0;
+        const char* begin = line.data() + listen.size();
+        const char* end = line.data() + line.size();
+        auto [ptr, ec] = std::from_chars(begin, end, port);
+        if (ec == std::errc() && ptr == end && port && port != listenPort)
+        {
+            lg2::info("Resuming the retirement of port {PORT} of {OBJPATH}",
+                      "PORT", port, "OBJPATH", objPath);
+            retiringPort = port;
+            claimPorts();
+            schedulePortRetirement();
+        }
+        return;
+    }
+}
+
+void ServiceConfig::writeSocketOverrideConf(const PlannedDropIn& dropIn)
+{
+    createSocketOverrideConf();
+    // Create override config file and write data.
+    std::string tmpFile{dropIn.path + "_tmp"};
+    std::ofstream cfgFile(tmpFile, std::ios::out);
+    if (!cfgFile.good())
+    {
+        lg2::error("Failed to open the {TMPFILE} file.", "TMPFILE", tmpFile);
+        phosphor::logging::elog<
+            sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure>();
+    }
+    cfgFile << dropIn.contents;
+    cfgFile.close();
+
+    if (std::rename(tmpFile.c_str(), dropIn.path.c_str()) != 0)
+    {
+        lg2::error("Failed to rename {TMPFILE} file as {OVERCFGFILE} file.",
+                   "TMPFILE", tmpFile, "OVERCFGFILE", dropIn.path);
+        std::remove(tmpFile.c_str());
+        phosphor::logging::elog<
+            sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure>();
+    }
+}
+
+UnitApplyPlan ServiceConfig::planApply(const ServicePropertyMap& changes)
+{
+    if (!changes.empty())
+    {
+        // Plan as if the changes were staged, then put the staged state back.
+        // Staging only touches these members.
+        auto staged = std::make_tuple(portNum, unitMaskedState,
+                                      unitEnabledState, unitRunningState,
+                                      updatedFlag);
+        stageChanges(changes);
+        UnitApplyPlan plan = planApply();
+        std::tie(portNum, unitMaskedState, unitEnabledState, unitRunningState,
+                 updatedFlag) = staged;
+        claimPorts();
+        return plan;
+    }
+
+    UnitApplyPlan plan;
+    if (!updatedFlag || isMaskedOut())
+    {
+        // No updates / masked - nothing to do.
+        return plan;
+    }
+    plan.pending = true;
+
+    if (canMigratePort())
+    {
+        // Restarting the socket binds the new port along with the one it
+        // listens on now. Once it only listens on the new port, this drops
+        // the previous one.
+        plan.retirePort = (listenPort != portNum) ? listenPort : 0;
+        plan.dropIn =
+            PlannedDropIn{getOverrideConfDir() + "/" + overrideConfFileName,
+                          getSocketOverrideConf(plan.retirePort)};
+        plan.restartUnits.push_back(getSocketUnitName());
+        return plan;
+    }
+
+    if (unitSubState == UnitSubState::running ||
+        unitSubState == UnitSubState::listening)
+    {
+        if (hasSocketUnit)
+        {
+            plan.stopUnits.push_back(getSocketUnitName());
+        }
+        if (!isSocketActivatedService)
+        {
+            plan.stopUnits.push_back(getServiceUnitName());
+        }
+        else
+        {
+            // For socket-activated service, each connection will spawn a
+            // service instance from template. All spawned service
+            // `<unitName>@<attribute>.service` need to be stopped.
+            plan.stopInstances = std::string(baseUnitName) + "@*.service";
+        }
+    }
+
+    if (updatedFlag & (1 << static_cast<uint8_t>(UpdatedProp::port)))
+    {
+        plan.dropIn = PlannedDropIn{
+            getOverrideConfDir() + "/" + overrideConfFileName,
+            getSocketOverrideConf()};
+    }
+
+    if (updatedFlag & ((1 << static_cast<uint8_t>(UpdatedProp::maskedState)) |
+                       (1 << static_cast<uint8_t>(UpdatedProp::enabledState))))
+    {
+        if (!hasSocketUnit)
+        {
+            plan.unitFiles = {getServiceUnitName()};
+        }
+        else if (!hasServiceUnit)
+        {
+            plan.unitFiles = {getSocketUnitName()};
+        }
+        else
+        {
+            plan.unitFiles = {getSocketUnitName(), getServiceUnitName()};
+        }
+        plan.unitFilesMethods = getUnitFilesStateChanges(
+            unitFileState, unitMaskedState, unitEnabledState);
+    }
+
+    if (unitRunningState)
+    {
+        if (hasSocketUnit)
+        {
+            plan.restartUnits.push_back(getSocketUnitName());
+        }
+        if (hasServiceUnit)
+        {
+            plan.restartUnits.push_back(getServiceUnitName());
+        }
+    }
+    return plan;
+}
+
+static uint64_t toEpochUsec(std::chrono::system_clock::time_point time)
+{
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               time.time_since_epoch())
+        .count();
+}
+
+static void addTransitionTime(std::optional<UnitJobTimes>& times,
+                              uint64_t jobStart, uint64_t from, uint64_t to)
+{
+    // Only count transitions the job made, not ones left from before it
+    if (from < jobStart || to < from)
+    {
+        return;
+    }
+    if (!times)
+    {
+        times = UnitJobTimes{.start = jobStart};
+    }
+    times->unit += std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::microseconds(to - from));
+}
+
+boost::asio::awaitable<void> ServiceConfig::timedUnitAction(
+    const std::string& unit, const char* action)
+{
+    uint64_t jobStart = toEpochUsec(std::chrono::system_clock::now());
+    auto start = std::chrono::steady_clock::now();
+    co_await systemdUnitAction(conn, unit, action);
+    auto jobTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+
+    // A restart is counted as a start, with the stop it may include counted
+    // with the stop time
+    bool isStop = std::string_view(action) == sysdStopUnit;
+    auto& times = isStop ? cycleStopTimes : cycleStartTimes;
+    if (!times)
+    {
+        times = UnitJobTimes{.start = jobStart};
+    }
+    times->job += jobTime;
+
+    auto transitions = co_await getUnitTransitionTimes(conn, unit);
+    addTransitionTime(cycleStopTimes, jobStart, transitions.activeExit,
+                      transitions.inactiveEnter);
+    if (!isStop)
+    {
+        addTransitionTime(cycleStartTimes, jobStart, transitions.inactiveExit,
+                          transitions.activeEnter);
+    }
+}
+
+static void addUnitJobTimes(UnitJobTimesHistory& history,
+                            std::optional<UnitJobTimes>& times)
+{
+    if (!times)
+    {
+        return;
+    }
+    if (history.size() == unitJobTimesHistorySize)
+    {
+        history.erase(history.begin());
+    }
+    history.emplace_back(times->start, times->job.count(),
+                         times->unit.count());
+    times.reset();
+}
+
+void ServiceConfig::publishUnitJobTimes()
+{
+    addUnitJobTimes(stopTimes, cycleStopTimes);
+    addUnitJobTimes(startTimes, cycleStartTimes);
+    if (applyStatusIface && applyStatusIface->is_initialized())
+    {
+        applyStatusIface->set_property(applyStatusPropStopTimes, stopTimes);
+        applyStatusIface->set_property(applyStatusPropStartTimes, startTimes);
+    }
+}
+
+boost::asio::awaitable<void> ServiceConfig::stopAndApplyUnitConfig()
+{
+    UnitApplyPlan plan = planApply();
+    if (!plan.pending)
+    {
+        co_return;
+    }
+    lg2::info("Applying new settings: {OBJPATH}", "OBJPATH", objPath);
+    for (const auto& unit : plan.stopUnits)
+    {
+        co_await timedUnitAction(unit, sysdStopUnit);
+    }
+    if (!plan.stopInstances.empty())
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::string instancePrefix = std::string(baseUnitName) + "@";
+        boost::system::error_code ec;
+        auto method = conn->new_method_call(sysdService, sysdObjPath,
+                                            sysdMgrIntf, "ListUnits");
+        auto listUnits = co_await conn->async_send(
+            method,
+            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
+
+        checkAndThrowInternalFailure(ec, "async_send error: ListUnits failed");
+
+        std::vector<std::string> instances;
+        forEachListedUnit(listUnits, [&](const ListedUnit& unit) {
+            if (unit.name.starts_with(instancePrefix) &&
+                unit.name.ends_with(".service") &&
+                unit.subState == subStateRunning)
+            {
+                instances.emplace_back(unit.name);
+            }
+        });
+        for (const auto& service : instances)
+        {
+            co_await timedUnitAction(service, sysdStopUnit);
+        }
+        recordSystemdDuration(
+            sysdStopUnit, plan.stopInstances,
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::steady_clock::now() - start));
+    }
+
+    if (plan.dropIn)
+    {
+        writeSocketOverrideConf(*plan.dropIn);
+    }
+
+    if (!plan.unitFilesMethods.empty())
+    {
+        co_await systemdUnitFilesStateChange(conn, plan.unitFiles,
+                                             plan.unitFilesMethods);
+    }
+}
+boost::asio::awaitable<void> ServiceConfig::restartUnitConfig()
+{
+    UnitApplyPlan plan = planApply();
+    if (!plan.pending)
+    {
+        // No updates. Just return.
+        co_return;
+    }
+
+    for (const auto& unit : plan.restartUnits)
+    {
+        co_await timedUnitAction(unit, sysdRestartUnit);
+    }
+
+    // Reset the flag
+    updatedFlag = 0;
+    applySnapshot.reset();
+
+    // Only a new drop-in changes the ports the socket listens on
+    if (plan.dropIn)
+    {
+        retiringPort = plan.retirePort;
+        claimPorts();
+        if (retiringPort)
+        {
+            schedulePortRetirement();
+        }
+        else if (portRetireTimer)
+        {
+            portRetireTimer->cancel();
+        }
+    }
+
+    lg2::info("Applied new settings: {OBJPATH} {UNIT_RUNNING_STATE}", "OBJPATH",
+              objPath, "UNIT_RUNNING_STATE", unitRunningState);
+}
+
+void ServiceConfig::takeApplySnapshot()
+{
+    UnitApplyPlan plan = planApply();
+    ApplySnapshot snapshot;
+    snapshot.running = (unitSubState == UnitSubState::running ||
+                        unitSubState == UnitSubState::listening);
+    // A port migration restarts the socket without stopping it first, so
+    // its stop list is empty
+    snapshot.units = (snapshot.running && !plan.stopUnits.empty())
+                         ? plan.stopUnits
+                         : plan.restartUnits;
+    if (plan.dropIn)
+    {
+        snapshot.restoreDropIn = true;
+        std::ifstream cfgFile(plan.dropIn->path);
+        if (cfgFile.good())
+        {
+            snapshot.dropIn.emplace(std::istreambuf_iterator<char>(cfgFile),
+                                    std::istreambuf_iterator<char>());
+        }
+    }
+    if (!plan.unitFilesMethods.empty())
+    {
+        snapshot.unitFiles = plan.unitFiles;
+        snapshot.unitFileState = unitFileState;
+    }
+    applySnapshot = std::move(snapshot);
+}
+
+boost::asio::awaitable<void> ServiceConfig::restoreUnitConfig()
+{
+    if (!applySnapshot)
+    {
+        co_return;
+    }
+    // The snapshot is kept for restartRestoredUnits()
+    const ApplySnapshot& snapshot = *applySnapshot;
+    updatedFlag = 0;
+    lg2::error("Rolling back new settings: {OBJPATH}", "OBJPATH", objPath);
+
+    if (snapshot.restoreDropIn)
+    {
+        std::string ovrCfgFile{getOverrideConfDir() + "/" +
+                               overrideConfFileName};
+        if (snapshot.dropIn)
+        {
+            writeSocketOverrideConf({ovrCfgFile, *snapshot.dropIn});
+        }
+        else
+        {
+            std::filesystem::remove(ovrCfgFile);
+        }
+    }
+
+    // What was done of the unit file changes isn't known, so make every call
+    // that leads back to the previous state
+    std::vector<UnitFilesMethod> methods;
+    switch (snapshot.unitFileState)
+    {
+        case UnitFileState::masked:
+            methods = {UnitFilesMethod::mask};
+            break;
+        case UnitFileState::enabled:
+            methods = {UnitFilesMethod::unmask, UnitFilesMethod::enable};
+            break;
+        case UnitFileState::disabled:
+            methods = {UnitFilesMethod::unmask, UnitFilesMethod::disable};
+            break;
+        case UnitFileState::other:
+            break;
+    }
+    if (!snapshot.unitFiles.empty() && !methods.empty())
+    {
+        co_await systemdUnitFilesStateChange(conn, snapshot.unitFiles,
+                                             methods);
+    }
+
+}
+
+boost::asio::awaitable<void> ServiceConfig::restartRestoredUnits()
+{
+    if (!applySnapshot)
+    {
+        co_return;
+    }
+    ApplySnapshot snapshot = std::move(*applySnapshot);
+    applySnapshot.reset();
+    for (const auto& unit : snapshot.units)
+    {
+        co_await systemdUnitAction(
+            conn, unit, snapshot.running ? sysdRestartUnit : sysdStopUnit);
+    }
+    lg2::error("Rolled back new settings: {OBJPATH}", "OBJPATH", objPath);
+}
+
+void ServiceConfig::discardStagedChanges()
+{
+    // Put back the state last read from systemd, in memory only. Staged
+    // values may come from the state file, which is left as it is.
+    updatedFlag = 0;
+    setApplyState(ApplyState::idle);
+    unitRunningState = (unitSubState != UnitSubState::other);
+    updateServiceProperties(unitFileState, unitSubState);
+    if (hasSocketUnit && listenPort)
+    {
+        updateSocketProperties({protocol, listenPort});
+    }
+}
+
+void ServiceConfig::markDirty()
+{
+    dirtyObjects.emplace(objPath);
+    setApplyState(ApplyState::staged);
+}
+
+const char* applyStateName(ApplyState state)
+{
+    switch (state)
+    {
+        case ApplyState::staged:
+            return "Staged";
+        case ApplyState::applying:
+            return "Applying";
+        case ApplyState::failed:
+            return "Failed";
+        case ApplyState::idle:
+            break;
+    }
+    return "Idle";
+}
+
+void ServiceConfig::setApplyState(ApplyState state)
+{
+    applyState = state;
+    if (applyStatusIface && applyStatusIface->is_initialized())
+    {
+        applyStatusIface->set_property(applyStatusPropState,
+                                       std::string(applyStateName(state)));
+        applyStatusIface->set_property(applyStatusPropPending,
+                                       updatedPropNames(updatedFlag));
+    }
+}
+
+void ServiceConfig::finishApply(const ApplyObjectRecord& record)
+{
+    lastApplyResult = record.rolledBack ? applyResultRolledBack
+                                        : applyOutcomeName(record.outcome);
+    if (applyStatusIface && applyStatusIface->is_initialized())
+    {
+        applyStatusIface->set_property(applyStatusPropResult, lastApplyResult);
+    }
+    publishUnitJobTimes();
+    setApplyState(record.outcome == ApplyOutcome::success ? ApplyState::idle
+                                                          : ApplyState::failed);
+}
+
+void setApplyCompletedHandler(std::function<void(const ApplyRecord&)> handler)
+{
+    applyCompletedHandler = std::move(handler);
+}
+
+// Empty the dirty set, returning the objects that still have changes staged
+static std::vector<std::shared_ptr<ServiceConfig>> takeDirtyObjects()
+{
+    std::vector<std::shared_ptr<ServiceConfig>> objects;
+    for (const auto& objPath : dirtyObjects)
+    {
+        auto it = srvMgrObjects.find(objPath);
+        if (it != srvMgrObjects.end() && it->second->updatedFlag)
+        {
+            objects.push_back(it->second);
+        }
+    }
+    dirtyObjects.clear();
+    return objects;
+}
+
+static void addPlannedCall(ApplyPlan& plan, const std::string& method,
+                           std::vector<std::string> units)
+{
+    auto estimate = estimateSystemdDuration(method, joinUnitNames(units));
+    plan.estimate += estimate;
+    plan.calls.emplace_back(method, std::move(units), estimate);
+}
+
+ApplyPlan buildApplyPlan(
+    const std::map<std::string, ServicePropertyMap>& changes)
+{
+    // Same order as the apply cycle: stop and apply per object,
+    // daemon-reload, then restart per object
+    ApplyPlan plan;
+    std::vector<std::string> restartUnits;
+    std::set<std::string> objPaths = dirtyObjects;
+    for (const auto& [objPath, objChanges] : changes)
+    {
+        objPaths.emplace(objPath);
+    }
+    for (const auto& objPath : objPaths)
+    {
+        auto srvObj = srvMgrObjects.find(objPath);
+        if (srvObj == srvMgrObjects.end())
+        {
+            continue;
+        }
+        auto it = changes.find(objPath);
+        UnitApplyPlan unitPlan = srvObj->second->planApply(
+            it != changes.end() ? it->second : ServicePropertyMap{});
+        if (!unitPlan.pending)
+        {
+            continue;
+        }
+        plan.daemonReload = true;
+        for (auto& unit : unitPlan.stopUnits)
+        {
+            addPlannedCall(plan, sysdStopUnit, {std::move(unit)});
+        }
+        if (!unitPlan.stopInstances.empty())
+        {
+            addPlannedCall(plan, sysdStopUnit,
+                           {std::move(unitPlan.stopInstances)});
+        }
+        if (unitPlan.dropIn)
+        {
+            plan.dropIns.push_back(std::move(*unitPlan.dropIn));
+        }
+        for (auto method : unitPlan.unitFilesMethods)
+        {
+            addPlannedCall(plan, unitFilesMethodName(method),
+                           unitPlan.unitFiles);
+        }
+        std::move(unitPlan.restartUnits.begin(), unitPlan.restartUnits.end(),
+                  std::back_inserter(restartUnits));
+    }
+    if (plan.daemonReload)
+    {
+        addPlannedCall(plan, sysdReloadMethod, {});
+    }
+    for (auto& unit : restartUnits)
+    {
+        addPlannedCall(plan, sysdRestartUnit, {std::move(unit)});
+    }
+    return plan;
+}
+
+void setDryRun(bool enabled)
+{
+    dryRun = enabled;
+}
+
+static void logDryRunPlan()
+{
+    ApplyPlan plan = buildApplyPlan();
+    for (const auto& call : plan.calls)
+    {
+        lg2::info("Dry run: {METHOD} {UNITS}", "METHOD", call.method, "UNITS",
+                  joinUnitNames(call.units));
+    }
+    for (const auto& dropIn : plan.dropIns)
+    {
+        lg2::info("Dry run: write {PATH}", "PATH", dropIn.path);
+    }
+    lg2::info("Dry run: estimated {MS} ms", "MS", plan.estimate.count());
+    for (auto& srvObj : takeDirtyObjects())
+    {
+        srvObj->discardStagedChanges();
+    }
+}
+
+bool isUpdateInProgress()
+{
+    return updateInProgress;
+}
+
+void runAfterApplyCycle(std::function<void()> callback)
+{
+    if (!updateInProgress)
+    {
+        callback();
+        return;
+    }
+    afterApplyCycle.push_back(std::move(callback));
+}
+
+static void endApplyCycle()
+{
+    updateInProgress = false;
+    // A cycle cut short by an exception leaves the call log on
+    setSystemdCallLog(nullptr, 0);
+    // Callbacks may start another cycle, which queues anew
+    auto callbacks = std::exchange(afterApplyCycle, {});
+    for (auto& callback : callbacks)
+    {
+        callback();
+    }
+}
+
+const WriteStatistics& getWriteStatistics()
+{
+    return writeStatistics;
+}
+
+static void checkWriteAdmission(TokenBucket* objectLimiter)
+{
+    if ((objectLimiter && !objectLimiter->available()) ||
+        !globalWriteLimiter.available())
+    {
+        ++writeStatistics.throttled;
+        // Thrown directly rather than through elog, so that a write storm
+        // doesn't turn into a journal storm
+        throw sdbusplus::xyz::openbmc_project::Common::Error::Unavailable();
+    }
+    if (objectLimiter)
+    {
+        objectLimiter->consume();
+    }
+    globalWriteLimiter.consume();
+}
+
+void admitBulkWrite()
+{
+    checkWriteAdmission(nullptr);
+}
+
+void ServiceConfig::admitWrite()
+{
+    checkWriteAdmission(&writeLimiter);
+}
+
+static boost::asio::awaitable<ApplyOutcome> runApplyStep(
+    ServiceConfig& srvObj, boost::asio::awaitable<void> step)
+{
+    try
+    {
+        co_await std::move(step);
+        co_return ApplyOutcome::success;
+    }
+    catch (const sdbusplus::xyz::openbmc_project::Common::Error::Timeout& e)
+    {
+        srvObj.reportApplyFailure(e, true);
+        co_return ApplyOutcome::timedOut;
+    }
+    catch (const std::exception& e)
+    {
+        srvObj.reportApplyFailure(e, false);
+    }
+    co_return ApplyOutcome::failed;
+}
+
+const char* applyOutcomeName(ApplyOutcome outcome)
+{
+    switch (outcome)
+    {
+        case ApplyOutcome::failed:
+            return "Failed";
+        case ApplyOutcome::timedOut:
+            return "TimedOut";
+        case ApplyOutcome::success:
+            break;
+    }
+    return "Success";
+}
+
+std::vector<std::string> updatedPropNames(uint8_t updatedFlag)
+{
+    std::vector<std::string> names;
+    for (auto [prop, name] :
+         {std::pair{UpdatedProp::port, sockAttrPropPort},
+          std::pair{UpdatedProp::maskedState, srvCfgPropMasked},
+          std::pair{UpdatedProp::enabledState, srvCfgPropEnabled},
+          std::pair{UpdatedProp::runningState, srvCfgPropRunning}})
+    {
+        if (updatedFlag & (1 << static_cast<uint8_t>(prop)))
+        {
+            names.emplace_back(name);
+        }
+    }
+    return names;
+}
+
+std::vector<const ApplyRecord*> getApplyHistory()
+{
+    std::vector<const ApplyRecord*> records;
+    size_t first = applyHistoryNext + applyHistorySize - applyHistoryCount;
+    for (size_t i = 0; i < applyHistoryCount; i++)
+    {
+        records.push_back(&applyHistory[(first + i) % applyHistorySize]);
+    }
+    return records;
 }
-#endif
 
-void ServiceConfig::updateSocketProperties(
-    const boost::container::flat_map<std::string, VariantType>& propertyMap)
+ApplyObjectRecord ServiceConfig::startApplyRecord()
 {
-    auto listenIt = propertyMap.find("Listen");
-    if (listenIt != propertyMap.end())
+    ApplyObjectRecord record{objPath, updatedFlag, {}, ApplyOutcome::success};
+    UnitApplyPlan plan = planApply();
+    for (auto* units : {&plan.stopUnits, &plan.unitFiles, &plan.restartUnits})
     {
-        auto listenVal =
-            std::get<std::vector<std::tuple<std::string, std::string>>>(
-                listenIt->second);
-        if (listenVal.size())
+        for (auto& unit : *units)
         {
-            protocol = std::get<0>(listenVal[0]);
-            std::string port = std::get<1>(listenVal[0]);
-            auto tmp = std::stoul(port.substr(port.find_last_of(":") + 1),
-                                  nullptr, 10);
-            if (tmp > std::numeric_limits<uint16_t>::max())
-            {
-                throw std::out_of_range("Out of range");
-            }
-            portNum = tmp;
-            if (sockAttrIface && sockAttrIface->is_initialized())
+            if (std::ranges::find(record.units, unit) == record.units.end())
             {
-                internalSet = true;
-                sockAttrIface->set_property(sockAttrPropPort, portNum);
-                internalSet = false;
+                record.units.push_back(std::move(unit));
             }
         }
     }
+    if (!plan.stopInstances.empty())
+    {
+        record.units.push_back(std::move(plan.stopInstances));
+    }
+    return record;
+}
+
+static void setOutcome(ApplyOutcome& outcome, ApplyOutcome stepOutcome)
+{
+    // The worst outcome of the steps sticks
+    outcome = std::max(outcome, stepOutcome);
 }
 
-void ServiceConfig::updateServiceProperties(
-    const boost::container::flat_map<std::string, VariantType>& propertyMap)
+// Takes the connection by value, the coroutine outlives the timer handler
+// that starts it
+static boost::asio::awaitable<void> runApplyCycle(
+    std::shared_ptr<sdbusplus::asio::connection> conn)
 {
-    auto stateIt = propertyMap.find("UnitFileState");
-    if (stateIt != propertyMap.end())
+    ApplyRecord& record = cycleRecord;
+    record.start = std::chrono::system_clock::now();
+    record.objects.clear();
+    record.calls.clear();
+    record.outcome = ApplyOutcome::success;
+    setSystemdCallLog(&record.calls, applyHistoryMaxCalls);
+
+    // Objects of the cycle, in step with record.objects
+    std::vector<std::shared_ptr<ServiceConfig>> pending = takeDirtyObjects();
+    for (auto& srvObj : pending)
     {
-        stateValue = std::get<std::string>(stateIt->second);
-        unitEnabledState = unitMaskedState = false;
-        if (stateValue == stateMasked)
-        {
-            unitMaskedState = true;
-        }
-        else if (stateValue == stateEnabled)
+        record.objects.push_back(srvObj->startApplyRecord());
+        srvObj->setApplyState(ApplyState::applying);
+    }
+
+    auto phaseStart = std::chrono::steady_clock::now();
+    auto endPhase = [&phaseStart]() {
+        auto now = std::chrono::steady_clock::now();
+        auto duration =
+            std::chrono::duration_cast<std::chrono::milliseconds>(
+                now - phaseStart);
+        phaseStart = now;
+        return duration;
+    };
+
+    // A failure (or timeout) of one object is reported on that object and
+    // the rest of the cycle carries on
+    // Stop and apply configuration for all objects
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        auto& srvObj = pending[i];
+        srvObj->takeApplySnapshot();
+        setOutcome(record.objects[i].outcome,
+                   co_await runApplyStep(*srvObj,
+                                         srvObj->stopAndApplyUnitConfig()));
+    }
+    record.stopDuration = endPhase();
+    // Do system reload
+    try
+    {
+        co_await systemdDaemonReload(conn);
+    }
+    catch (const std::exception& e)
+    {
+        lg2::error("daemon-reload failed: {ERROR}", "ERROR", e);
+        setOutcome(record.outcome, ApplyOutcome::failed);
+    }
+    record.reloadDuration = endPhase();
+    // restart unit config.
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        auto& srvObj = pending[i];
+        if (!srvObj->updatedFlag ||
+            record.objects[i].outcome != ApplyOutcome::success)
         {
-            unitEnabledState = true;
+            // Failed objects are rolled back rather than restarted
+            continue;
         }
-        if (srvCfgIface && srvCfgIface->is_initialized())
+        setOutcome(record.objects[i].outcome,
+                   co_await runApplyStep(*srvObj, srvObj->restartUnitConfig()));
+    }
+    record.restartDuration = endPhase();
+    // Put failed objects back as they were before the cycle, so that they
+    // aren't left stopped or with a broken drop-in. All of their files are
+    // restored first, for a single daemon-reload before their units restart.
+    std::vector<size_t> restored;
+    for (size_t i = 0; i < pending.size(); i++)
+    {
+        auto& srvObj = pending[i];
+        if (record.objects[i].outcome != ApplyOutcome::success)
         {
-            internalSet = true;
-            srvCfgIface->set_property(srvCfgPropMasked, unitMaskedState);
-            srvCfgIface->set_property(srvCfgPropEnabled, unitEnabledState);
-            internalSet = false;
+            if (co_await runApplyStep(*srvObj, srvObj->restoreUnitConfig()) ==
+                ApplyOutcome::success)
+            {
+                restored.push_back(i);
+            }
+            // Don't retry the same change on every cycle
+            srvObj->updatedFlag = 0;
         }
     }
-    auto subStateIt = propertyMap.find("SubState");
-    if (subStateIt != propertyMap.end())
+    if (!restored.empty())
     {
-        subStateValue = std::get<std::string>(subStateIt->second);
-        if (subStateValue == subStateRunning ||
-            subStateValue == subStateListening)
+        try
         {
-            unitRunningState = true;
+            co_await systemdDaemonReload(conn);
         }
-        if (srvCfgIface && srvCfgIface->is_initialized())
+        catch (const std::exception& e)
         {
-            internalSet = true;
-            srvCfgIface->set_property(srvCfgPropRunning, unitRunningState);
-            internalSet = false;
+            lg2::error("daemon-reload failed on rollback: {ERROR}", "ERROR",
+                       e);
+            restored.clear();
         }
     }
-
-#ifdef USB_CODE_UPDATE
-    if (baseUnitName == usbCodeUpdateUnitName)
+    for (size_t i : restored)
     {
-        getUSBCodeUpdateStateFromFile();
+        auto& srvObj = pending[i];
+        record.objects[i].rolledBack =
+            (co_await runApplyStep(*srvObj, srvObj->restartRestoredUnits()) ==
+             ApplyOutcome::success);
     }
-#endif
-}
+    // Read back the resulting state of all the objects of the cycle at once.
+    // Until it is in, the cycle isn't over: the outcome isn't published and
+    // writes are still turned away, so none is overwritten by the refresh.
+    co_await ServiceConfig::awaitRefreshProperties(conn, pending);
 
-void ServiceConfig::queryAndUpdateProperties(bool isRestore = false)
-{
-    std::string objectPath =
-        isSocketActivatedService ? socketObjectPath : serviceObjectPath;
-    if (objectPath.empty())
+    setSystemdCallLog(nullptr, 0);
+    for (size_t i = 0; i < pending.size(); i++)
     {
-        return;
+        pending[i]->finishApply(record.objects[i]);
+        setOutcome(record.outcome, record.objects[i].outcome);
     }
-
-    conn->async_method_call(
-        [this,
-         isRestore](boost::system::error_code ec,
-                    const boost::container::flat_map<std::string, VariantType>&
-                        propertyMap) {
-            if (ec)
-            {
-                lg2::error(
-                    "async_method_call error: Failed to service unit properties: {EC}",
-                    "EC", ec.value());
-                return;
-            }
-            try
-            {
-                updateServiceProperties(propertyMap);
-                if (!socketObjectPath.empty())
-                {
-                    conn->async_method_call(
-                        [this](boost::system::error_code ec,
-                               const boost::container::flat_map<
-                                   std::string, VariantType>& propertyMap) {
-                            if (ec)
-                            {
-                                lg2::error(
-                                    "async_method_call error: Failed to get all property: {EC}",
-                                    "EC", ec.value());
-                                return;
-                            }
-                            try
-                            {
-                                updateSocketProperties(propertyMap);
-                                if (!srvCfgIface)
-                                {
-                                    registerProperties();
-                                }
-                            }
-                            catch (const std::exception& e)
-                            {
-                                lg2::error(
-                                    "Exception in getting socket properties: {ERROR}",
-                                    "ERROR", e);
-                                return;
-                            }
-                        },
-                        sysdService, socketObjectPath, dBusPropIntf,
-                        dBusGetAllMethod, sysdSocketIntf);
-                }
-                else if (!srvCfgIface)
-                {
-                    registerProperties();
-                }
-                if (isRestore)
-                {
-                    // On startup or when notified of a persistent data change,
-                    // load our persistent settings and compare to
-                    // what was read from systemd. If they are different, use
-                    // the persistent settings
-                    loadStateFile();
-                }
-                else
-                {
-                    // This is just an update once we're already running so
-                    // write the values out to our persistent settings
-                    writeStateFile();
-                }
-            }
-            catch (const std::exception& e)
-            {
-                lg2::error("Exception in getting socket properties: {ERROR}",
-                           "ERROR", e);
-                return;
-            }
-        },
-        sysdService, objectPath, dBusPropIntf, dBusGetAllMethod, sysdUnitIntf);
-    return;
-}
-
-void ServiceConfig::createSocketOverrideConf()
-{
-    if (!socketObjectPath.empty())
+    ApplyRecord& entry = applyHistory[applyHistoryNext];
+    std::swap(entry, record);
+    applyHistoryNext = (applyHistoryNext + 1) % applyHistorySize;
+    applyHistoryCount = std::min(applyHistoryCount + 1, applyHistorySize);
+    if (applyCompletedHandler)
     {
-        std::string socketUnitName(instantiatedUnitName + ".socket");
-        /// Check override socket directory exist, if not create it.
-        std::filesystem::path ovrUnitFileDir(systemdOverrideUnitBasePath);
-        ovrUnitFileDir += socketUnitName;
-        ovrUnitFileDir += ".d";
-        if (!std::filesystem::exists(ovrUnitFileDir))
-        {
-            if (!std::filesystem::create_directories(ovrUnitFileDir))
-            {
-                lg2::error("Unable to create the {DIR} directory.", "DIR",
-                           ovrUnitFileDir);
-                phosphor::logging::elog<sdbusplus::xyz::openbmc_project::
-                                            Common::Error::InternalFailure>();
-            }
-        }
-        overrideConfDir = std::string(ovrUnitFileDir);
+        applyCompletedHandler(entry);
     }
 }
 
-void ServiceConfig::writeStateFile()
-{
-#ifdef PERSIST_SETTINGS
-    lg2::debug("Writing Persistent State File Information to {STATE_FILE}",
-               "STATE_FILE", stateFile);
-    nlohmann::json stateMap;
-    stateMap[persistDataFileVersionStr] = persistDataFileVersion;
-    stateMap[srvCfgPropMasked] = unitMaskedState;
-    stateMap[srvCfgPropEnabled] = unitEnabledState;
-    stateMap[srvCfgPropRunning] = unitRunningState;
-
-    std::ofstream file(stateFile);
-    file << stateMap;
-    file.close();
-#endif
-}
-
-void ServiceConfig::loadStateFile()
+void scheduleServiceApply(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    std::chrono::seconds delay)
 {
-#ifdef PERSIST_SETTINGS
-    lg2::debug("Loading Persistent State File Information from {STATE_FILE}",
-               "STATE_FILE", stateFile);
-    if (std::filesystem::exists(stateFile))
+    auto deadline = std::chrono::steady_clock::now() + delay;
+    if (applyPending && timer->expiry() <= deadline)
     {
-        std::ifstream file(stateFile);
-        if (!file.good())
+        // Join the pending cycle. Later writes may bring the apply forward
+        // but never push it out, so a stream of writes can't starve it.
+        return;
+    }
+    applyPending = true;
+    timer->expires_at(deadline);
+    timer->async_wait([conn](const boost::system::error_code& ec) {
+        if (ec == boost::asio::error::operation_aborted)
         {
-            lg2::error("Error reading {FILEPATH}; delete it and continue",
-                       "FILEPATH", stateFile);
-            std::filesystem::remove(stateFile);
-            // rewrite file with what was ready from systemd
-            writeStateFile();
+            // Timer reset.
             return;
         }
-
-        nlohmann::json stateMap =
-            nlohmann::json::parse(file, nullptr, false, true);
-        if (stateMap.is_discarded())
+        applyPending = false;
+        if (ec)
         {
-            lg2::error("Error loading {FILEPATH}; delete it and continue",
-                       "FILEPATH", stateFile);
-            std::filesystem::remove(stateFile);
-            // rewrite file with what was ready from systemd
-            writeStateFile();
+            lg2::error("async wait error: {EC}", "EC", ec.value());
             return;
         }
-        else if (stateMap[persistDataFileVersionStr] != persistDataFileVersion)
+        if (dryRun)
         {
-            lg2::error(
-                "Error version:{VERSION} read from {FILEPATH} does not match expected {VERSION_EXP}; delete it and continue",
-                "VERSION", stateMap[persistDataFileVersionStr], "FILEPATH",
-                stateFile, "VERSION_EXP", persistDataFileVersion);
-            std::filesystem::remove(stateFile);
-            // rewrite file with what was ready from systemd
-            writeStateFile();
+            // Report what the cycle would do instead of doing it
+            logDryRunPlan();
             return;
         }
-
-        // If there are any differences, the persistent config file wins so
-        // update the dbus properties and trigger a reload to apply the changes
-        if (stateMap[srvCfgPropMasked] != unitMaskedState)
-        {
-            lg2::info(
-                "Masked property for {FILEPATH} not equal. Setting to {SETTING}",
-                "FILEPATH", stateFile, "SETTING", stateMap[srvCfgPropMasked]);
-            unitMaskedState = stateMap[srvCfgPropMasked];
-            updatedFlag |=
-                (1 << static_cast<uint8_t>(UpdatedProp::maskedState));
-            startServiceRestartTimer();
-        }
-        if (stateMap[srvCfgPropEnabled] != unitEnabledState)
-        {
-            lg2::info(
-                "Enabled property for {FILEPATH} not equal. Setting to {SETTING}",
-                "FILEPATH", stateFile, "SETTING", stateMap[srvCfgPropEnabled]);
-            unitEnabledState = stateMap[srvCfgPropEnabled];
-            updatedFlag |=
-                (1 << static_cast<uint8_t>(UpdatedProp::enabledState));
-            startServiceRestartTimer();
-        }
-        if (stateMap[srvCfgPropRunning] != unitRunningState)
+        if (updateInProgress)
         {
-            lg2::info(
-                "Running property for {FILEPATH} not equal. Setting to {SETTING}",
-                "FILEPATH", stateFile, "SETTING", stateMap[srvCfgPropRunning]);
-            unitRunningState = stateMap[srvCfgPropRunning];
-            updatedFlag |=
-                (1 << static_cast<uint8_t>(UpdatedProp::runningState));
-            startServiceRestartTimer();
+            // Only one cycle at a time, the changes go in the next one
+            runAfterApplyCycle([conn]() {
+                scheduleServiceApply(conn, std::chrono::seconds(0));
+            });
+            return;
         }
-    }
-    else
-    {
-        // Just write out what we got from systemd if no existing config file
-        writeStateFile();
-    }
-#endif
+        updateInProgress = true;
+        // Whatever isn't accounted elsewhere while the cycle runs is its own
+        setDefaultAllocSubsystem(AllocSubsystem::apply);
+        boost::asio::co_spawn(conn->get_io_context(), runApplyCycle(conn),
+                              [](std::exception_ptr e) {
+                                  setDefaultAllocSubsystem(
+                                      AllocSubsystem::other);
+                                  endApplyCycle();
+                                  if (!e)
+                                  {
+                                      return;
+                                  }
+                                  // Rethrowing would take the daemon down
+                                  // from io.run()
+                                  try
+                                  {
+                                      std::rethrow_exception(e);
+                                  }
+                                  catch (const std::exception& ex)
+                                  {
+                                      lg2::error("Apply cycle failed: {ERROR}",
+                                                 "ERROR", ex);
+                                  }
+                                  catch (...)
+                                  {
+                                      lg2::error("Apply cycle failed");
+                                  }
+                              });
+    });
 }
 
-void ServiceConfig::reloadServiceConfig()
+void ServiceConfig::startServiceRestartTimer()
 {
-    queryAndUpdateProperties(true);
+    markDirty();
+    scheduleServiceApply(conn, std::chrono::seconds(restartTimeout));
 }
 
-ServiceConfig::ServiceConfig(
-    sdbusplus::asio::object_server& srv_,
-    std::shared_ptr<sdbusplus::asio::connection>& conn_,
-    const std::string& objPath_, const std::string& baseUnitName_,
-    const std::string& instanceName_, const std::string& serviceObjPath_,
-    const std::string& socketObjPath_) :
-    conn(conn_), server(srv_), objPath(objPath_), baseUnitName(baseUnitName_),
-    instanceName(instanceName_), serviceObjectPath(serviceObjPath_),
-    socketObjectPath(socketObjPath_)
-{
-    isSocketActivatedService = serviceObjectPath.empty();
-    instantiatedUnitName = baseUnitName + addInstanceName(instanceName, "@");
-    updatedFlag = 0;
-    stateFile = srvDataBaseDir + instantiatedUnitName;
-    queryAndUpdateProperties(true);
-    return;
+void ServiceConfig::stageMaskedState(bool state)
+{
+    unitMaskedState = state;
+    unitEnabledState = !unitMaskedState;
+    unitRunningState = !unitMaskedState;
+    updatedFlag |= (1 << static_cast<uint8_t>(UpdatedProp::maskedState)) |
+                   (1 << static_cast<uint8_t>(UpdatedProp::enabledState)) |
+                   (1 << static_cast<uint8_t>(UpdatedProp::runningState));
 }
 
-std::string ServiceConfig::getSocketUnitName()
+void ServiceConfig::stageEnabledState(bool state)
 {
-    return instantiatedUnitName + ".socket";
+    unitEnabledState = state;
+    updatedFlag |= (1 << static_cast<uint8_t>(UpdatedProp::enabledState));
 }
 
-std::string ServiceConfig::getServiceUnitName()
+void ServiceConfig::stageRunningState(bool state)
 {
-    return instantiatedUnitName + ".service";
+    unitRunningState = state;
+    updatedFlag |= (1 << static_cast<uint8_t>(UpdatedProp::runningState));
 }
 
-bool ServiceConfig::isMaskedOut()
+void ServiceConfig::stagePort(uint16_t port)
 {
-    // return true  if state is masked & no request to update the maskedState
-    return (
-        stateValue == "masked" &&
-        !(updatedFlag & (1 << static_cast<uint8_t>(UpdatedProp::maskedState))));
+    portNum = port;
+    updatedFlag |= (1 << static_cast<uint8_t>(UpdatedProp::port));
+    claimPorts();
 }
 
-void ServiceConfig::stopAndApplyUnitConfig(boost::asio::yield_context yield)
+void ServiceConfig::claimPorts()
 {
-    if (!updatedFlag || isMaskedOut())
+    // Port 0 is never claimed, which makes key 0 free to mean no claim
+    std::array<uint32_t, 3> claims{};
+    if (listenPort)
+    {
+        claims[0] = portIndexKey(protocol, listenPort);
+    }
+    if (portNum && portNum != listenPort)
+    {
+        claims[1] = portIndexKey(protocol, portNum);
+    }
+    if (retiringPort && retiringPort != listenPort && retiringPort != portNum)
+    {
+        claims[2] = portIndexKey(protocol, retiringPort);
+    }
+    if (claims == portClaims)
     {
-        // No updates / masked - Just return.
         return;
     }
-    lg2::info("Applying new settings: {OBJPATH}", "OBJPATH", objPath);
-    if (subStateValue == subStateRunning || subStateValue == subStateListening)
+    for (uint32_t key : portClaims)
     {
-        if (!socketObjectPath.empty())
+        if (!key)
         {
-            systemdUnitAction(conn, yield, getSocketUnitName(), sysdStopUnit);
+            continue;
         }
-        if (!isSocketActivatedService)
+        auto [begin, end] = portIndex.equal_range(key);
+        auto it = std::find_if(begin, end, [this](const auto& entry) {
+            return entry.second == this;
+        });
+        if (it != end)
         {
-            systemdUnitAction(conn, yield, getServiceUnitName(), sysdStopUnit);
+            portIndex.erase(it);
         }
-        else
+    }
+    for (uint32_t key : claims)
+    {
+        if (key)
         {
-            // For socket-activated service, each connection will spawn a
-            // service instance from template. Need to find all spawned service
-            // `<unitName>@<attribute>.service` and stop them through the
-            // systemdUnitAction method
-            boost::system::error_code ec;
-            auto listUnits =
-                conn->yield_method_call<std::vector<ListUnitsType>>(
-                    yield, ec, sysdService, sysdObjPath, sysdMgrIntf,
-                    "ListUnits");
-
-            checkAndThrowInternalFailure(
-                ec, "yield_method_call error: ListUnits failed");
-
-            for (const auto& unit : listUnits)
+            portIndex.emplace(key, this);
+        }
+    }
+    portClaims = claims;
+}
+
+std::string ServiceConfig::checkPortConflict(uint16_t port) const
+{
+    auto [begin, end] = portIndex.equal_range(portIndexKey(protocol, port));
+    for (auto it = begin; it != end; ++it)
+    {
+        if (it->second != this)
+        {
+            return "Port " + std::to_string(port) + " is used by " +
+                   it->second->objPath;
+        }
+    }
+    // Our own socket is the only managed listener allowed on the port, any
+    // other is outside of our control
+    if (port != listenPort && port != retiringPort &&
+        isPortListening(protocol, port))
+    {
+        return "Port " + std::to_string(port) + " is in use";
+    }
+    return {};
+}
+
+void ServiceConfig::publishProperties()
+{
+    internalSet = true;
+    if (srvCfgIface && srvCfgIface->is_initialized())
+    {
+        srvCfgIface->set_property(srvCfgPropMasked, unitMaskedState);
+        srvCfgIface->set_property(srvCfgPropEnabled, unitEnabledState);
+        srvCfgIface->set_property(srvCfgPropRunning, unitRunningState);
+    }
+    if (sockAttrIface && sockAttrIface->is_initialized())
+    {
+        sockAttrIface->set_property(sockAttrPropPort, portNum);
+    }
+    internalSet = false;
+}
+
+ServicePropertyMap ServiceConfig::getProperties() const
+{
+    ServicePropertyMap properties = {{srvCfgPropMasked, unitMaskedState},
+                                     {srvCfgPropEnabled, unitEnabledState},
+                                     {srvCfgPropRunning, unitRunningState}};
+    if (hasSocketUnit)
+    {
+        properties.emplace(sockAttrPropPort, portNum);
+    }
+    return properties;
+}
+
+// A masked unit can't be enabled or started. Shared by the property setters
+// and the batch checks so that both apply the same rule.
+static bool blockedByMask(bool maskedState, bool requested)
+{
+    return maskedState && requested;
+}
+
+std::string ServiceConfig::checkPropertyChanges(
+    const ServicePropertyMap& changes, BatchPortClaims* batchPorts) const
+{
+    if (!srvCfgIface)
+    {
+        return "Service properties are not available yet";
+    }
+    bool maskedState = unitMaskedState;
+    for (const auto& [name, value] : changes)
+    {
+        if (name == sockAttrPropPort)
+        {
+            if (!hasSocketUnit)
+            {
+                return "Port is not supported by this service";
+            }
+            if (!std::holds_alternative<uint16_t>(value))
+            {
+                return "Invalid type for Port";
+            }
+            uint16_t port = std::get<uint16_t>(value);
+            if (port != portNum)
+            {
+                std::string error = checkPortConflict(port);
+                if (!error.empty())
+                {
+                    return error;
+                }
+            }
+            if (batchPorts)
             {
-                const auto& service =
-                    std::get<static_cast<int>(ListUnitElements::name)>(unit);
-                const auto& status =
-                    std::get<static_cast<int>(ListUnitElements::subState)>(
-                        unit);
-                if (service.find(baseUnitName + "@") != std::string::npos &&
-                    service.find(".service") != std::string::npos &&
-                    status == subStateRunning)
+                auto [claim, claimed] =
+                    batchPorts->emplace(portIndexKey(protocol, port), objPath);
+                if (!claimed)
                 {
-                    systemdUnitAction(conn, yield, service, sysdStopUnit);
+                    return "Port " + std::to_string(port) +
+                           " is also requested for " + claim->second;
                 }
             }
+            continue;
+        }
+        if (name != srvCfgPropMasked && name != srvCfgPropEnabled &&
+            name != srvCfgPropRunning)
+        {
+            return "Unknown property " + name;
+        }
+        if (!std::holds_alternative<bool>(value))
+        {
+            return "Invalid type for " + name;
+        }
+        if (name == srvCfgPropMasked)
+        {
+            maskedState = std::get<bool>(value);
         }
     }
 
-    if (updatedFlag & (1 << static_cast<uint8_t>(UpdatedProp::port)))
+    // Checked against the masked state the batch leaves, so a batch can
+    // unmask and start a unit at once, or mask it and can't start it
+    for (const char* name : {srvCfgPropEnabled, srvCfgPropRunning})
     {
-        createSocketOverrideConf();
-        // Create override config file and write data.
-        std::string ovrCfgFile{overrideConfDir + "/" + overrideConfFileName};
-        std::string tmpFile{ovrCfgFile + "_tmp"};
-        std::ofstream cfgFile(tmpFile, std::ios::out);
-        if (!cfgFile.good())
+        auto it = changes.find(name);
+        if (it != changes.end() &&
+            blockedByMask(maskedState, std::get<bool>(it->second)))
         {
-            lg2::error("Failed to open the {TMPFILE} file.", "TMPFILE",
-                       tmpFile);
-            phosphor::logging::elog<sdbusplus::xyz::openbmc_project::Common::
-                                        Error::InternalFailure>();
+            return std::string(name) + " can not be set while masked";
         }
+    }
+    return {};
+}
 
-        // Write the socket header
-        cfgFile << "[Socket]\n";
-        // Listen
-        cfgFile << "Listen" << protocol << "="
-                << "\n";
-        cfgFile << "Listen" << protocol << "=" << portNum << "\n";
-        cfgFile.close();
-
-        if (std::rename(tmpFile.c_str(), ovrCfgFile.c_str()) != 0)
+bool ServiceConfig::hasPropertyChanges(const ServicePropertyMap& changes) const
+{
+    // Any value that differs is staged, see stageChanges()
+    return std::ranges::any_of(changes, [this](const auto& change) {
+        const auto& [name, value] = change;
+        if (name == sockAttrPropPort)
         {
-            lg2::error("Failed to rename {TMPFILE} file as {OVERCFGFILE} file.",
-                       "TMPFILE", tmpFile, "OVERCFGFILE", ovrCfgFile);
-            std::remove(tmpFile.c_str());
-            phosphor::logging::elog<sdbusplus::xyz::openbmc_project::Common::
-                                        Error::InternalFailure>();
+            return std::get<uint16_t>(value) != portNum;
         }
-    }
+        bool state = std::get<bool>(value);
+        return (name == srvCfgPropMasked && state != unitMaskedState) ||
+               (name == srvCfgPropEnabled && state != unitEnabledState) ||
+               (name == srvCfgPropRunning && state != unitRunningState);
+    });
+}
 
-    if (updatedFlag & ((1 << static_cast<uint8_t>(UpdatedProp::maskedState)) |
-                       (1 << static_cast<uint8_t>(UpdatedProp::enabledState))))
+bool ServiceConfig::stageChanges(const ServicePropertyMap& changes)
+{
+    bool changed = false;
+    // Masked goes first as it also resets Enabled and Running
+    auto maskedIt = changes.find(srvCfgPropMasked);
+    if (maskedIt != changes.end() &&
+        std::get<bool>(maskedIt->second) != unitMaskedState)
     {
-        std::vector<std::string> unitFiles;
-        if (socketObjectPath.empty())
+        stageMaskedState(std::get<bool>(maskedIt->second));
+        changed = true;
+    }
+    for (const auto& [name, value] : changes)
+    {
+        if (name == srvCfgPropEnabled &&
+            std::get<bool>(value) != unitEnabledState)
         {
-            unitFiles = {getServiceUnitName()};
+            stageEnabledState(std::get<bool>(value));
+            changed = true;
         }
-        else if (serviceObjectPath.empty())
+        else if (name == srvCfgPropRunning &&
+                 std::get<bool>(value) != unitRunningState)
         {
-            unitFiles = {getSocketUnitName()};
+            stageRunningState(std::get<bool>(value));
+            changed = true;
         }
-        else
+        else if (name == sockAttrPropPort &&
+                 std::get<uint16_t>(value) != portNum)
         {
-            unitFiles = {getSocketUnitName(), getServiceUnitName()};
+            stagePort(std::get<uint16_t>(value));
+            changed = true;
         }
-        systemdUnitFilesStateChange(conn, yield, unitFiles, stateValue,
-                                    unitMaskedState, unitEnabledState);
     }
-    return;
+    return changed;
 }
-void ServiceConfig::restartUnitConfig(boost::asio::yield_context yield)
+
+bool ServiceConfig::stagePropertyChanges(const ServicePropertyMap& changes)
 {
-    if (!updatedFlag || isMaskedOut())
+    if (!stageChanges(changes))
     {
-        // No updates. Just return.
-        return;
+        return false;
     }
 
-    if (unitRunningState)
+#ifdef USB_CODE_UPDATE
+    if (baseUnitName == usbCodeUpdateUnitName)
     {
-        if (!socketObjectPath.empty())
-        {
-            systemdUnitAction(conn, yield, getSocketUnitName(),
-                              sysdRestartUnit);
-        }
-        if (!serviceObjectPath.empty())
+        // Enabled and Running are a single state for the USB code update
+        // pseudo unit, and it is applied right away instead of by the
+        // systemd apply cycle
+        if (changes.contains(srvCfgPropRunning))
         {
-            systemdUnitAction(conn, yield, getServiceUnitName(),
-                              sysdRestartUnit);
+            unitEnabledState = unitRunningState;
         }
+        unitRunningState = unitEnabledState;
+        updatedFlag = 0;
+        publishProperties();
+        queueUSBCodeUpdateWrite();
+        return true;
     }
+#endif
 
-    // Reset the flag
-    updatedFlag = 0;
-
-    lg2::info("Applied new settings: {OBJPATH} {UNIT_RUNNING_STATE}", "OBJPATH",
-              objPath, "UNIT_RUNNING_STATE", unitRunningState);
-
-    queryAndUpdateProperties();
-    return;
+    markDirty();
+    publishProperties();
+    return true;
 }
 
-void ServiceConfig::startServiceRestartTimer()
+void ServiceConfig::reportApplyFailure(const std::exception& e, bool timedOut)
 {
-    timer->expires_after(std::chrono::seconds(restartTimeout));
-    timer->async_wait([this](const boost::system::error_code& ec) {
-        if (ec == boost::asio::error::operation_aborted)
-        {
-            // Timer reset.
-            return;
-        }
-        else if (ec)
-        {
-            lg2::error("async wait error: {EC}", "EC", ec.value());
-            return;
-        }
-        updateInProgress = true;
-        boost::asio::spawn(
-            conn->get_io_context(),
-            [this](boost::asio::yield_context yield) {
-                // Stop and apply configuration for all objects
-                for (auto& srvMgrObj : srvMgrObjects)
-                {
-                    auto& srvObj = srvMgrObj.second;
-                    if (srvObj->updatedFlag)
-                    {
-                        srvObj->stopAndApplyUnitConfig(yield);
-                    }
-                }
-                // Do system reload
-                systemdDaemonReload(conn, yield);
-                // restart unit config.
-                for (auto& srvMgrObj : srvMgrObjects)
-                {
-                    auto& srvObj = srvMgrObj.second;
-                    if (srvObj->updatedFlag)
-                    {
-                        srvObj->restartUnitConfig(yield);
-                    }
-                }
-                updateInProgress = false;
-            },
-            boost::asio::detached);
-    });
+    lg2::error("Failed to apply new settings: {OBJPATH} {TIMEOUT} {ERROR}",
+               "OBJPATH", objPath, "TIMEOUT", timedOut, "ERROR", e);
 }
 
 void ServiceConfig::registerProperties()
 {
+    AllocScope allocScope(AllocSubsystem::objectServer);
+    StartupPhaseTimer phaseTimer(StartupPhase::registration);
     srvCfgIface = server.add_interface(objPath, serviceConfigIntfName);
 
-    if (!socketObjectPath.empty())
+    if (hasSocketUnit)
     {
         sockAttrIface = server.add_interface(objPath, sockAttrIntfName);
         sockAttrIface->register_property(
@@ -670,15 +2211,24 @@ void ServiceConfig::registerProperties()
                 {
                     if (req == res)
                     {
+                        ++writeStatistics.coalesced;
                         return 1;
                     }
                     if (updateInProgress)
                     {
                         return 0;
                     }
-                    portNum = req;
-                    updatedFlag |=
-                        (1 << static_cast<uint8_t>(UpdatedProp::port));
+                    std::string error = checkPortConflict(req);
+                    if (!error.empty())
+                    {
+                        lg2::error("Rejected port change: {OBJPATH} {ERROR}",
+                                   "OBJPATH", objPath, "ERROR", error);
+                        phosphor::logging::elog<
+                            sdbusplus::xyz::openbmc_project::Common::Error::
+                                InvalidArgument>();
+                    }
+                    admitWrite();
+                    stagePort(req);
                     startServiceRestartTimer();
                 }
                 res = req;
@@ -693,6 +2243,12 @@ void ServiceConfig::registerProperties()
 #ifdef USB_CODE_UPDATE
                 if (baseUnitName == usbCodeUpdateUnitName)
                 {
+                    if (req == res)
+                    {
+                        ++writeStatistics.coalesced;
+                        return 1;
+                    }
+                    admitWrite();
                     unitMaskedState = req;
                     unitEnabledState = !unitMaskedState;
                     unitRunningState = !unitMaskedState;
@@ -704,27 +2260,21 @@ void ServiceConfig::registerProperties()
                     srvCfgIface->set_property(srvCfgPropMasked,
                                               unitMaskedState);
                     internalSet = false;
-                    setUSBCodeUpdateState(unitEnabledState);
-                    saveUSBCodeUpdateStateToFile(unitMaskedState,
-                                                 unitEnabledState);
+                    queueUSBCodeUpdateWrite();
                     return 1;
                 }
 #endif
                 if (req == res)
                 {
+                    ++writeStatistics.coalesced;
                     return 1;
                 }
                 if (updateInProgress)
                 {
                     return 0;
                 }
-                unitMaskedState = req;
-                unitEnabledState = !unitMaskedState;
-                unitRunningState = !unitMaskedState;
-                updatedFlag |=
-                    (1 << static_cast<uint8_t>(UpdatedProp::maskedState)) |
-                    (1 << static_cast<uint8_t>(UpdatedProp::enabledState)) |
-                    (1 << static_cast<uint8_t>(UpdatedProp::runningState));
+                admitWrite();
+                stageMaskedState(req);
                 internalSet = true;
                 srvCfgIface->set_property(srvCfgPropEnabled, unitEnabledState);
                 srvCfgIface->set_property(srvCfgPropRunning, unitRunningState);
@@ -748,6 +2298,12 @@ void ServiceConfig::registerProperties()
                         lg2::error("Invalid value specified");
                         return -EINVAL;
                     }
+                    if (req == res)
+                    {
+                        ++writeStatistics.coalesced;
+                        return 1;
+                    }
+                    admitWrite();
                     unitEnabledState = req;
                     unitRunningState = req;
                     internalSet = true;
@@ -756,29 +2312,27 @@ void ServiceConfig::registerProperties()
                     srvCfgIface->set_property(srvCfgPropRunning,
                                               unitRunningState);
                     internalSet = false;
-                    setUSBCodeUpdateState(unitEnabledState);
-                    saveUSBCodeUpdateStateToFile(unitMaskedState,
-                                                 unitEnabledState);
+                    queueUSBCodeUpdateWrite();
                     res = req;
                     return 1;
                 }
 #endif
                 if (req == res)
                 {
+                    ++writeStatistics.coalesced;
                     return 1;
                 }
                 if (updateInProgress)
                 {
                     return 0;
                 }
-                if (unitMaskedState)
+                if (blockedByMask(unitMaskedState, req))
                 { // block updating if masked
                     lg2::error("Invalid value specified");
                     return -EINVAL;
                 }
-                unitEnabledState = req;
-                updatedFlag |=
-                    (1 << static_cast<uint8_t>(UpdatedProp::enabledState));
+                admitWrite();
+                stageEnabledState(req);
                 startServiceRestartTimer();
             }
             res = req;
@@ -798,6 +2352,12 @@ void ServiceConfig::registerProperties()
                         lg2::error("Invalid value specified");
                         return -EINVAL;
                     }
+                    if (req == res)
+                    {
+                        ++writeStatistics.coalesced;
+                        return 1;
+                    }
+                    admitWrite();
                     unitEnabledState = req;
                     unitRunningState = req;
                     internalSet = true;
@@ -806,29 +2366,27 @@ void ServiceConfig::registerProperties()
                     srvCfgIface->set_property(srvCfgPropRunning,
                                               unitRunningState);
                     internalSet = false;
-                    setUSBCodeUpdateState(unitEnabledState);
-                    saveUSBCodeUpdateStateToFile(unitMaskedState,
-                                                 unitEnabledState);
+                    queueUSBCodeUpdateWrite();
                     res = req;
                     return 1;
                 }
 #endif
                 if (req == res)
                 {
+                    ++writeStatistics.coalesced;
                     return 1;
                 }
                 if (updateInProgress)
                 {
                     return 0;
                 }
-                if (unitMaskedState)
+                if (blockedByMask(unitMaskedState, req))
                 { // block updating if masked
                     lg2::error("Invalid value specified");
                     return -EINVAL;
                 }
-                unitRunningState = req;
-                updatedFlag |=
-                    (1 << static_cast<uint8_t>(UpdatedProp::runningState));
+                admitWrite();
+                stageRunningState(req);
                 startServiceRestartTimer();
             }
             res = req;
@@ -836,10 +2394,24 @@ void ServiceConfig::registerProperties()
         });
 
     srvCfgIface->initialize();
-    if (!socketObjectPath.empty())
+    if (hasSocketUnit)
     {
         sockAttrIface->initialize();
     }
+
+    // Lets clients wait for their changes to be applied instead of polling
+    // the properties above
+    applyStatusIface = server.add_interface(objPath, applyStatusIntfName);
+    applyStatusIface->register_property(applyStatusPropPending,
+                                        updatedPropNames(updatedFlag));
+    applyStatusIface->register_property(
+        applyStatusPropState, std::string(applyStateName(applyState)));
+    applyStatusIface->register_property(applyStatusPropResult,
+                                        lastApplyResult);
+    applyStatusIface->register_property(applyStatusPropStopTimes, stopTimes);
+    applyStatusIface->register_property(applyStatusPropStartTimes,
+                                        startTimes);
+    applyStatusIface->initialize();
     return;
 }
 
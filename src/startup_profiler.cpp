@@ -0,0 +1,189 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "startup_profiler.hpp"
+
+#include "srvcfg_manager.hpp"
+
+#include <systemd/sd-daemon.h>
+
+#include <array>
+
+namespace phosphor
+{
+namespace service
+{
+
+using StartupPhases = std::vector<std::tuple<std::string, uint64_t>>;
+
+static std::array<std::chrono::steady_clock::duration,
+                  static_cast<size_t>(StartupPhase::count)>
+    phaseDurations{};
+static std::array<std::chrono::steady_clock::time_point,
+                  static_cast<size_t>(StartupPhase::count)>
+    phaseStarts{};
+static size_t pendingObjects = 0;
+static bool startupComplete = false;
+static bool readySent = false;
+static std::shared_ptr<sdbusplus::asio::dbus_interface> startupIface;
+
+static const char* startupPhaseName(StartupPhase phase)
+{
+    switch (phase)
+    {
+        case StartupPhase::busConnect:
+            return "BusConnect";
+        case StartupPhase::listUnits:
+            return "ListUnits";
+        case StartupPhase::unitProperties:
+            return "UnitProperties";
+        case StartupPhase::stateFiles:
+            return "StateFiles";
+        case StartupPhase::registration:
+            return "Registration";
+        case StartupPhase::count:
+            break;
+    }
+    return "Unknown";
+}
+
+static StartupPhases getStartupPhases()
+{
+    StartupPhases phases;
+    for (size_t i = 0; i < phaseDurations.size(); i++)
+    {
+        phases.emplace_back(
+            startupPhaseName(static_cast<StartupPhase>(i)),
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                phaseDurations[i])
+                .count());
+    }
+    return phases;
+}
+
+static void publishStartupPhases()
+{
+    if (startupIface)
+    {
+        startupIface->set_property("Phases", getStartupPhases());
+        startupIface->set_property("Complete", startupComplete);
+    }
+}
+
+static void addPhaseDuration(StartupPhase phase,
+                             std::chrono::steady_clock::duration duration)
+{
+    if (!startupComplete)
+    {
+        phaseDurations[static_cast<size_t>(phase)] += duration;
+    }
+}
+
+void startStartupPhase(StartupPhase phase)
+{
+    phaseStarts[static_cast<size_t>(phase)] = std::chrono::steady_clock::now();
+    std::string status = std::string("STATUS=Starting: ") +
+                         startupPhaseName(phase);
+    sd_notify(0, status.c_str());
+}
+
+void endStartupPhase(StartupPhase phase)
+{
+    addPhaseDuration(phase, std::chrono::steady_clock::now() -
+                                phaseStarts[static_cast<size_t>(phase)]);
+    publishStartupPhases();
+}
+
+StartupPhaseTimer::StartupPhaseTimer(StartupPhase phase) :
+    phase(phase), start(std::chrono::steady_clock::now())
+{}
+
+StartupPhaseTimer::~StartupPhaseTimer()
+{
+    addPhaseDuration(phase, std::chrono::steady_clock::now() - start);
+}
+
+void registerStartupInterface(sdbusplus::asio::object_server& server)
+{
+    startupIface = server.add_interface(srcCfgMgrBasePath, startupIntfName);
+    startupIface->register_property("Phases", getStartupPhases());
+    startupIface->register_property("Complete", startupComplete);
+    startupIface->initialize();
+}
+
+static void completeStartup()
+{
+    endStartupPhase(StartupPhase::unitProperties);
+    startupComplete = true;
+    publishStartupPhases();
+
+    std::string status = "STATUS=Ready, startup ms:";
+    for (size_t i = 0; i < phaseDurations.size(); i++)
+    {
+        status += std::string(" ") +
+                  startupPhaseName(static_cast<StartupPhase>(i)) + "=" +
+                  std::to_string(
+                      std::chrono::duration_cast<std::chrono::milliseconds>(
+                          phaseDurations[i])
+                          .count());
+    }
+    lg2::info("Startup complete: {STATUS}", "STATUS", status);
+    if (!readySent)
+    {
+        readySent = true;
+        status = "READY=1\n" + status;
+    }
+    sd_notify(0, status.c_str());
+}
+
+void expectStartupObjects(size_t count)
+{
+    if (startupComplete)
+    {
+        return;
+    }
+    startStartupPhase(StartupPhase::unitProperties);
+    pendingObjects = count;
+    if (pendingObjects == 0)
+    {
+        completeStartup();
+    }
+}
+
+void startupObjectPublished()
+{
+    if (startupComplete || pendingObjects == 0)
+    {
+        return;
+    }
+    if (--pendingObjects == 0)
+    {
+        completeStartup();
+    }
+}
+
+void notifyReadyEarly(const std::string& status)
+{
+    std::string state = "STATUS=" + status;
+    if (!readySent)
+    {
+        readySent = true;
+        state = "READY=1\n" + state;
+    }
+    sd_notify(0, state.c_str());
+}
+
+} // namespace service
+} // namespace phosphor
@@ -0,0 +1,268 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "unit_file_watcher.hpp"
+
+#include <sys/inotify.h>
+
+namespace phosphor
+{
+namespace service
+{
+
+// Editors and tools touch several files in a row, refresh once after them
+static constexpr const auto changeSettleTime = std::chrono::seconds(1);
+static constexpr const uint32_t dirWatchMask =
+    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_CLOSE_WRITE |
+    IN_ONLYDIR;
+
+static bool isUnitLinkDir(std::string_view name)
+{
+    return name.ends_with(".wants") || name.ends_with(".requires");
+}
+
+UnitFileWatcher::UnitFileWatcher(
+    boost::asio::io_context& io,
+    std::shared_ptr<sdbusplus::asio::connection> conn,
+    const UnitRegistry& registry) :
+    conn(std::move(conn)), registry(registry), inotifyStream(io),
+    debounceTimer(io)
+{
+    int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd < 0)
+    {
+        lg2::error("Failed to initialize inotify, unit files not watched: "
+                   "{ERRNO}",
+                   "ERRNO", errno);
+        return;
+    }
+    inotifyStream.assign(fd);
+
+    addUnitDirWatch(systemdOverrideUnitBasePath);
+    std::error_code ec;
+    for (const auto& entry : std::filesystem::directory_iterator(
+             systemdOverrideUnitBasePath, ec))
+    {
+        if (entry.is_directory(ec) &&
+            isUnitLinkDir(entry.path().filename().native()))
+        {
+            addUnitDirWatch(entry.path());
+        }
+    }
+
+    subscribeSystemdSignals(this->conn);
+    reloadMatch = std::make_unique<sdbusplus::bus::match_t>(
+        static_cast<sdbusplus::bus_t&>(*this->conn),
+        "type='signal',"
+        "member='Reloading',path='/org/freedesktop/systemd1',"
+        "interface='org.freedesktop.systemd1.Manager'",
+        [this](sdbusplus::message_t& msg) {
+            bool active = true;
+            msg.read(active);
+            if (active || awaitingReload.empty())
+            {
+                return;
+            }
+            changed.merge(awaitingReload);
+            awaitingReload.clear();
+            scheduleRefresh();
+        });
+
+    readEvents();
+}
+
+void UnitFileWatcher::addUnitDirWatch(const std::string& dir)
+{
+    int wd = inotify_add_watch(inotifyStream.native_handle(), dir.c_str(),
+                               dirWatchMask);
+    if (wd < 0)
+    {
+        lg2::error("Failed to watch {DIR}: {ERRNO}", "DIR", dir, "ERRNO",
+                   errno);
+        return;
+    }
+    unitDirWatches[wd] = dir;
+}
+
+void UnitFileWatcher::addDropInWatch(const std::weak_ptr<ServiceConfig>& object)
+{
+    auto srvObj = object.lock();
+    if (!srvObj)
+    {
+        return;
+    }
+    // The directory may only be created later, which the watch on the unit
+    // directory catches
+    std::string dir = srvObj->getOverrideConfDir();
+    int wd = inotify_add_watch(inotifyStream.native_handle(), dir.c_str(),
+                               dirWatchMask);
+    if (wd >= 0)
+    {
+        dropInWatches[wd] = object;
+    }
+}
+
+void UnitFileWatcher::addObject(const std::shared_ptr<ServiceConfig>& object)
+{
+    if (!inotifyStream.is_open())
+    {
+        return;
+    }
+    addDropInWatch(object);
+}
+
+void UnitFileWatcher::readEvents()
+{
+    inotifyStream.async_read_some(
+        boost::asio::buffer(eventBuffer),
+        [this](const boost::system::error_code& ec, size_t size) {
+            if (ec)
+            {
+                lg2::error("Failed to read inotify events: {EC}", "EC",
+                           ec.value());
+                return;
+            }
+            size_t offset = 0;
+            while (offset + sizeof(inotify_event) <= size)
+            {
+                const auto* event = reinterpret_cast<const inotify_event*>(
+                    eventBuffer.data() + offset);
+                handleEvent(*event);
+                offset += sizeof(inotify_event) + event->len;
+            }
+            readEvents();
+        });
+}
+
+void UnitFileWatcher::handleEvent(const inotify_event& event)
+{
+    if (event.mask & IN_Q_OVERFLOW)
+    {
+        // Events were lost, any object may have changed
+        lg2::error("inotify event queue overflow, refreshing all objects");
+        for (const auto& [objPath, object] : registry)
+        {
+            markChanged(object);
+        }
+        return;
+    }
+    if (event.mask & IN_IGNORED)
+    {
+        // The watched directory was removed
+        unitDirWatches.erase(event.wd);
+        dropInWatches.erase(event.wd);
+        return;
+    }
+
+    auto dropIn = dropInWatches.find(event.wd);
+    if (dropIn != dropInWatches.end())
+    {
+        markChanged(dropIn->second);
+        return;
+    }
+    auto unitDir = unitDirWatches.find(event.wd);
+    if (unitDir == unitDirWatches.end() || !event.len)
+    {
+        return;
+    }
+    std::string name(event.name);
+    if ((event.mask & (IN_CREATE | IN_MOVED_TO)) && (event.mask & IN_ISDIR) &&
+        isUnitLinkDir(name))
+    {
+        addUnitDirWatch(std::filesystem::path(unitDir->second) / name);
+        return;
+    }
+    // Unit files are named after their unit, and drop-in directories after
+    // their unit with a .d suffix
+    std::string_view unitName(name);
+    if (unitName.ends_with(".d"))
+    {
+        unitName.remove_suffix(2);
+    }
+    auto owner = registry.findByUnitName(unitName);
+    if (!owner)
+    {
+        return;
+    }
+    if ((event.mask & (IN_CREATE | IN_MOVED_TO)) && (event.mask & IN_ISDIR))
+    {
+        // New drop-in directory
+        addDropInWatch(owner);
+    }
+    markChanged(owner);
+}
+
+void UnitFileWatcher::markChanged(const std::weak_ptr<ServiceConfig>& object)
+{
+    // Our own changes are read back at the end of the apply cycle. Changes
+    // to other objects are refreshed once the cycle is over.
+    auto srvObj = object.lock();
+    if (!srvObj || srvObj->isApplying())
+    {
+        return;
+    }
+    changed.insert(object);
+    awaitingReload.insert(object);
+    scheduleRefresh();
+}
+
+void UnitFileWatcher::scheduleRefresh()
+{
+    debounceTimer.expires_after(changeSettleTime);
+    debounceTimer.async_wait([this](const boost::system::error_code& ec) {
+        if (ec == boost::asio::error::operation_aborted)
+        {
+            // Timer reset.
+            return;
+        }
+        if (ec)
+        {
+            lg2::error("async wait error: {EC}", "EC", ec.value());
+            return;
+        }
+        refresh();
+    });
+}
+
+void UnitFileWatcher::refresh()
+{
+    if (isUpdateInProgress())
+    {
+        // The refresh would race with the apply cycle, wait for it
+        scheduleRefresh();
+        return;
+    }
+    std::vector<std::shared_ptr<ServiceConfig>> objects;
+    for (const auto& object : changed)
+    {
+        auto srvObj = object.lock();
+        // Reading the state back would overwrite what is staged. The apply
+        // of the staged changes reads it back anyway.
+        if (srvObj && !srvObj->updatedFlag)
+        {
+            objects.push_back(std::move(srvObj));
+        }
+    }
+    changed.clear();
+    if (!objects.empty())
+    {
+        lg2::info("Refreshing {COUNT} objects after unit file changes",
+                  "COUNT", objects.size());
+        ServiceConfig::refreshProperties(conn, std::move(objects));
+    }
+}
+
+} // namespace service
+} // namespace phosphor
@@ -0,0 +1,75 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "unit_registry.hpp"
+
+#include "srvcfg_manager.hpp"
+
+namespace phosphor
+{
+namespace service
+{
+
+std::vector<std::string> UnitRegistry::unitKeys(
+    const ServiceConfig& object) const
+{
+    std::vector<std::string> keys = object.getUnitFileNames();
+    keys.push_back(object.getInstantiatedUnitName());
+    return keys;
+}
+
+UnitHandle UnitRegistry::add(const std::string& objPath,
+                             std::shared_ptr<ServiceConfig> object)
+{
+    if (objects.contains(objPath))
+    {
+        return {};
+    }
+    auto slot = static_cast<uint32_t>(slots.size());
+    slots.emplace_back();
+    slots[slot].object = object;
+    for (auto& key : unitKeys(*object))
+    {
+        byUnitName.emplace(std::move(key), slot);
+    }
+    UnitHandle handle{slot, slots[slot].generation};
+    object->handle = handle;
+    objects.emplace(objPath, std::move(object));
+    return handle;
+}
+
+std::shared_ptr<ServiceConfig> UnitRegistry::get(UnitHandle handle) const
+{
+    if (handle.slot >= slots.size() ||
+        slots[handle.slot].generation != handle.generation)
+    {
+        return nullptr;
+    }
+    return slots[handle.slot].object;
+}
+
+std::shared_ptr<ServiceConfig> UnitRegistry::findByUnitName(
+    std::string_view unitName) const
+{
+    auto it = byUnitName.find(unitName);
+    if (it == byUnitName.end())
+    {
+        return nullptr;
+    }
+    return slots[it->second].object;
+}
+
+} // namespace service
+} // namespace phosphor
@@ -15,6 +15,304 @@
 */
 #include "utils.hpp"
 
+#include <boost/asio/redirect_error.hpp>
+#include <boost/asio/use_awaitable.hpp>
+#include <sdbusplus/bus/match.hpp>
+
+#include <charconv>
+#include <fstream>
+#include <sstream>
+#include <unordered_map>
+#include <unordered_set>
+
+// Used for systemd calls that have no recorded history yet
+static constexpr const auto defaultSystemdDuration =
+    std::chrono::milliseconds(1000);
+
+static std::unordered_map<std::string, std::chrono::milliseconds>
+    systemdDurations;
+
+static std::vector<SystemdCallResult>* systemdCallLog = nullptr;
+static size_t systemdCallLogMax = 0;
+
+UnitFileState toUnitFileState(std::string_view state)
+{
+    if (state == stateEnabled)
+    {
+        return UnitFileState::enabled;
+    }
+    if (state == stateDisabled)
+    {
+        return UnitFileState::disabled;
+    }
+    if (state == stateMasked)
+    {
+        return UnitFileState::masked;
+    }
+    return UnitFileState::other;
+}
+
+UnitSubState toUnitSubState(std::string_view subState)
+{
+    if (subState == subStateRunning)
+    {
+        return UnitSubState::running;
+    }
+    if (subState == subStateListening)
+    {
+        return UnitSubState::listening;
+    }
+    return UnitSubState::other;
+}
+
+std::optional<SocketProtocol> toSocketProtocol(std::string_view protocol)
+{
+    for (auto value : {SocketProtocol::stream, SocketProtocol::datagram,
+                       SocketProtocol::sequentialPacket})
+    {
+        if (protocol == socketProtocolName(value))
+        {
+            return value;
+        }
+    }
+    return std::nullopt;
+}
+
+const char* socketProtocolName(SocketProtocol protocol)
+{
+    switch (protocol)
+    {
+        case SocketProtocol::datagram:
+            return "Datagram";
+        case SocketProtocol::sequentialPacket:
+            return "SequentialPacket";
+        case SocketProtocol::stream:
+            break;
+    }
+    return "Stream";
+}
+
+// Socket states in /proc/net/{tcp,udp}[6] that hold the local port
+static constexpr const char* procTcpListen = "0A";
+static constexpr const char* procUdpBound = "07";
+
+static bool procNetHasPort(const char* file, const char* state, uint16_t port)
+{
+    std::ifstream table(file);
+    std::string line;
+    // Skip the header
+    std::getline(table, line);
+    while (std::getline(table, line))
+    {
+        // "  sl  local_address rem_address   st ...", with the local address
+        // as <hex address>:<hex port>
+        std::istringstream fields(line);
+        std::string slot;
+        std::string local;
+        std::string remote;
+        std::string st;
+        fields >> slot >> local >> remote >> st;
+        auto colon = local.rfind(':');
+        if (colon == std::string::npos || st != state)
+        {
+            continue;
+        }
+        uint16_t localPort = 0;
+        const char* begin = local.data() + colon + 1;
+        const char* end = local.data() + local.size();
+        auto [ptr, ec] = std::from_chars(begin, end, localPort, 16);
+        if (ec == std::errc() && ptr == end && localPort == port)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+bool isPortListening(SocketProtocol protocol, uint16_t port)
+{
+    switch (protocol)
+    {
+        case SocketProtocol::stream:
+            return procNetHasPort("/proc/net/tcp", procTcpListen, port) ||
+                   procNetHasPort("/proc/net/tcp6", procTcpListen, port);
+        case SocketProtocol::datagram:
+            return procNetHasPort("/proc/net/udp", procUdpBound, port) ||
+                   procNetHasPort("/proc/net/udp6", procUdpBound, port);
+        case SocketProtocol::sequentialPacket:
+            break;
+    }
+    return false;
+}
+
+static void checkMessageRead(int r, const char* what)
+{
+    if (r < 0)
+    {
+        lg2::error("Failed to decode {WHAT}: {ERRNO}", "WHAT", what, "ERRNO",
+                   -r);
+        phosphor::logging::elog<
+            sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure>();
+    }
+}
+
+std::string_view readStringProperty(sdbusplus::message_t& msg)
+{
+    const char* value = nullptr;
+    checkMessageRead(sd_bus_message_enter_container(
+                         msg.get(), SD_BUS_TYPE_VARIANT, "s"),
+                     "string property");
+    checkMessageRead(
+        sd_bus_message_read_basic(msg.get(), SD_BUS_TYPE_STRING, &value),
+        "string property");
+    return value;
+}
+
+std::optional<ListenAddress> readListenProperty(sdbusplus::message_t& msg)
+{
+    const char* type = nullptr;
+    const char* address = nullptr;
+    checkMessageRead(sd_bus_message_enter_container(
+                         msg.get(), SD_BUS_TYPE_VARIANT, "a(ss)"),
+                     "Listen property");
+    checkMessageRead(
+        sd_bus_message_enter_container(msg.get(), SD_BUS_TYPE_ARRAY, "(ss)"),
+        "Listen property");
+    int r = sd_bus_message_read(msg.get(), "(ss)", &type, &address);
+    checkMessageRead(r, "Listen property");
+    if (r == 0)
+    {
+        // Nothing to listen on
+        return std::nullopt;
+    }
+
+    auto protocol = toSocketProtocol(type);
+    if (!protocol)
+    {
+        lg2::error("Unsupported socket type {TYPE}", "TYPE", type);
+        return std::nullopt;
+    }
+    std::string_view addressView(address);
+    std::string_view portView =
+        addressView.substr(addressView.find_last_of(':') + 1);
+    uint16_t port = 0;
+    auto [end, ec] = std::from_chars(
+        portView.data(), portView.data() + portView.size(), port);
+    if (ec != std::errc() || end != portView.data() + portView.size())
+    {
+        throw std::out_of_range("Out of range");
+    }
+    return ListenAddress{*protocol, port};
+}
+
+void forEachListedUnit(sdbusplus::message_t& msg,
+                       const std::function<void(const ListedUnit&)>& callback)
+{
+    const char* name = nullptr;
+    const char* description = nullptr;
+    const char* loadState = nullptr;
+    const char* activeState = nullptr;
+    const char* subState = nullptr;
+    const char* followedUnit = nullptr;
+    const char* objectPath = nullptr;
+    uint32_t queuedJobType = 0;
+    const char* jobType = nullptr;
+    const char* jobObject = nullptr;
+
+    checkMessageRead(sd_bus_message_enter_container(
+                         msg.get(), SD_BUS_TYPE_ARRAY, "(ssssssouso)"),
+                     "ListUnits reply");
+    int r = 0;
+    while ((r = sd_bus_message_read(
+                msg.get(), "(ssssssouso)", &name, &description, &loadState,
+                &activeState, &subState, &followedUnit, &objectPath,
+                &queuedJobType, &jobType, &jobObject)) > 0)
+    {
+        callback(ListedUnit{name, loadState, subState, objectPath});
+    }
+    checkMessageRead(r, "ListUnits reply");
+    checkMessageRead(sd_bus_message_exit_container(msg.get()),
+                     "ListUnits reply");
+}
+
+const char* unitFilesMethodName(UnitFilesMethod method)
+{
+    switch (method)
+    {
+        case UnitFilesMethod::unmask:
+            return "UnmaskUnitFiles";
+        case UnitFilesMethod::mask:
+            return "MaskUnitFiles";
+        case UnitFilesMethod::enable:
+            return "EnableUnitFiles";
+        case UnitFilesMethod::disable:
+            break;
+    }
+    return "DisableUnitFiles";
+}
+
+std::string joinUnitNames(const std::vector<std::string>& units)
+{
+    std::string joined;
+    for (const auto& unit : units)
+    {
+        if (!joined.empty())
+        {
+            joined += " ";
+        }
+        joined += unit;
+    }
+    return joined;
+}
+
+void recordSystemdDuration(const std::string& method, const std::string& units,
+                           std::chrono::milliseconds duration)
+{
+    // Keyed by call, so the map is bounded by the managed units. Smoothed,
+    // so a single slow call doesn't dominate the estimate.
+    auto [it, inserted] =
+        systemdDurations.try_emplace(method + " " + units, duration);
+    if (!inserted)
+    {
+        it->second = (it->second * 3 + duration) / 4;
+    }
+}
+
+std::chrono::milliseconds estimateSystemdDuration(const std::string& method,
+                                                  const std::string& units)
+{
+    auto it = systemdDurations.find(method + " " + units);
+    return it != systemdDurations.end() ? it->second : defaultSystemdDuration;
+}
+
+void setSystemdCallLog(std::vector<SystemdCallResult>* log, size_t maxEntries)
+{
+    systemdCallLog = log;
+    systemdCallLogMax = maxEntries;
+}
+
+static void logSystemdCall(const std::string& method, const std::string& units,
+                           std::chrono::milliseconds duration,
+                           const char* result)
+{
+    if (systemdCallLog && systemdCallLog->size() < systemdCallLogMax)
+    {
+        systemdCallLog->emplace_back(method, units, duration, result);
+    }
+}
+
+std::string_view internString(std::string_view str)
+{
+    // Node based, so the strings never move once inserted
+    static std::unordered_set<std::string> pool;
+    return *pool.emplace(str).first;
+}
+
+std::string systemdUnitObjectPath(const std::string& unitName)
+{
+    return (sdbusplus::object_path(sysdUnitBasePath) / unitName).str;
+}
+
 void checkAndThrowInternalFailure(boost::system::error_code& ec,
                                   const std::string& msg)
 {
@@ -28,15 +326,94 @@ void checkAndThrowInternalFailure(boost::system::error_code& ec,
     return;
 }
 
-void systemdDaemonReload(
+using SystemdDeadline = std::chrono::steady_clock::time_point;
+
+static SystemdDeadline getSystemdDeadline()
+{
+    return std::chrono::steady_clock::now() + systemdJobTimeout;
+}
+
+static boost::asio::awaitable<sdbusplus::message_t> callWithDeadline(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    boost::system::error_code& ec, sdbusplus::message_t& method,
+    SystemdDeadline deadline)
+{
+    auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(
+        deadline - std::chrono::steady_clock::now());
+    // sd-bus reads a zero timeout as "use the default", so never pass it
+    uint64_t timeoutUsec = std::max<int64_t>(remaining.count(), 1);
+    co_return co_await conn->async_send(
+        method, boost::asio::redirect_error(boost::asio::use_awaitable, ec),
+        timeoutUsec);
+}
+
+void checkAndThrowSystemdFailure(boost::system::error_code& ec,
+                                 const std::string& msg)
+{
+    if (ec.value() == boost::system::errc::timed_out)
+    {
+        lg2::error("Systemd operation timed out: {MSG}", "MSG", msg);
+        phosphor::logging::elog<
+            sdbusplus::xyz::openbmc_project::Common::Error::Timeout>();
+    }
+    checkAndThrowInternalFailure(ec, msg);
+}
+
+template <typename... Args>
+static boost::asio::awaitable<void> systemdManagerCall(
     const std::shared_ptr<sdbusplus::asio::connection>& conn,
-    boost::asio::yield_context yield)
+    SystemdDeadline deadline, const char* methodName, const Args&... args)
 {
     boost::system::error_code ec;
-    conn->yield_method_call<>(yield, ec, sysdService, sysdObjPath, sysdMgrIntf,
-                              sysdReloadMethod);
-    checkAndThrowInternalFailure(ec, "daemon-reload operation failed");
-    return;
+    auto method = conn->new_method_call(sysdService, sysdObjPath, sysdMgrIntf,
+                                        methodName);
+    method.append(args...);
+    co_await callWithDeadline(conn, ec, method, deadline);
+    checkAndThrowSystemdFailure(
+        ec, std::string("Systemd ") + methodName + "() failed.");
+}
+
+static std::chrono::milliseconds elapsedSince(
+    std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now() - start);
+}
+
+// Run a systemd call, timing it and logging its result. The call is lazy and
+// only starts once awaited here.
+static boost::asio::awaitable<void> timedSystemdCall(
+    const std::string& method, const std::string& units,
+    boost::asio::awaitable<void> call)
+{
+    auto start = std::chrono::steady_clock::now();
+    try
+    {
+        co_await std::move(call);
+    }
+    catch (const sdbusplus::xyz::openbmc_project::Common::Error::Timeout&)
+    {
+        logSystemdCall(method, units, elapsedSince(start),
+                       systemdResultTimeout);
+        throw;
+    }
+    catch (const std::exception&)
+    {
+        logSystemdCall(method, units, elapsedSince(start),
+                       systemdResultFailed);
+        throw;
+    }
+    auto duration = elapsedSince(start);
+    recordSystemdDuration(method, units, duration);
+    logSystemdCall(method, units, duration, systemdResultDone);
+}
+
+boost::asio::awaitable<void> systemdDaemonReload(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn)
+{
+    co_await timedSystemdCall(
+        sysdReloadMethod, "",
+        systemdManagerCall(conn, getSystemdDeadline(), sysdReloadMethod));
 }
 
 static inline uint32_t getJobId(const std::string& path)
@@ -51,33 +428,167 @@ static inline uint32_t getJobId(const std::string& path)
     return static_cast<uint32_t>(std::stoul(path.substr(pos + 1)));
 }
 
-void systemdUnitAction(const std::shared_ptr<sdbusplus::asio::connection>& conn,
-                       boost::asio::yield_context yield,
-                       const std::string& unitName,
-                       const std::string& actionMethod)
+static boost::asio::awaitable<void> cancelJob(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    const std::string& jobPath)
 {
     boost::system::error_code ec;
-    auto jobPath = conn->yield_method_call<sdbusplus::object_path>(
-        yield, ec, sysdService, sysdObjPath, sysdMgrIntf, actionMethod,
-        unitName, sysdReplaceMode);
-    checkAndThrowInternalFailure(ec,
-                                 "Systemd operation failed, " + actionMethod);
+    auto method = conn->new_method_call(sysdService, jobPath.c_str(),
+                                        sysdJobIntf, sysdCancelMethod);
+    co_await callWithDeadline(conn, ec, method, getSystemdDeadline());
+    // The job may have completed in the meantime
+    if (ec && ec.value() != boost::system::errc::no_such_file_or_directory)
+    {
+        lg2::error("Failed to cancel systemd job {JOB}: {EC}", "JOB", jobPath,
+                   "EC", ec.value());
+    }
+}
+
+// Enough for the jobs of one unit action to be collected, even with other
+// clients running jobs at the same time
+static constexpr size_t jobResultsMax = 64;
+static JobResults jobResults(jobResultsMax);
+static std::unique_ptr<sdbusplus::bus::match_t> jobRemovedMatch;
+
+void JobResults::record(std::string jobPath, std::string result)
+{
+    if (results.size() >= maxEntries)
+    {
+        results.pop_front();
+    }
+    results.emplace_back(std::move(jobPath), std::move(result));
+}
+
+std::optional<std::string> JobResults::take(std::string_view jobPath)
+{
+    auto it = std::ranges::find(results, jobPath,
+                                &std::pair<std::string, std::string>::first);
+    if (it == results.end())
+    {
+        return std::nullopt;
+    }
+    std::string result = std::move(it->second);
+    results.erase(it);
+    return result;
+}
+
+void checkJobResult(std::string_view result, const std::string& msg)
+{
+    if (result == systemdResultDone || result == "skipped")
+    {
+        return;
+    }
+    lg2::error("{MSG}: job result {RESULT}", "MSG", msg, "RESULT", result);
+    if (result == systemdResultTimeout)
+    {
+        phosphor::logging::elog<
+            sdbusplus::xyz::openbmc_project::Common::Error::Timeout>();
+    }
+    phosphor::logging::elog<
+        sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure>();
+}
+
+void subscribeSystemdSignals(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn)
+{
+    static bool subscribed = false;
+    if (subscribed)
+    {
+        return;
+    }
+    subscribed = true;
+    conn->async_method_call(
+        [](boost::system::error_code ec) {
+            if (ec)
+            {
+                lg2::error("Failed to subscribe to systemd signals: {EC}",
+                           "EC", ec.value());
+            }
+        },
+        sysdService, sysdObjPath, sysdMgrIntf, "Subscribe");
+}
+
+void watchJobResults(const std::shared_ptr<sdbusplus::asio::connection>& conn)
+{
+    jobRemovedMatch = std::make_unique<sdbusplus::bus::match_t>(
+        static_cast<sdbusplus::bus_t&>(*conn),
+        "type='signal',"
+        "member='JobRemoved',path='/org/freedesktop/systemd1',"
+        "interface='org.freedesktop.systemd1.Manager'",
+        [](sdbusplus::message_t& msg) {
+            try
+            {
+                uint32_t id = 0;
+                sdbusplus::object_path jobPath;
+                std::string unit;
+                std::string result;
+                msg.read(id, jobPath, unit, result);
+                jobResults.record(std::move(jobPath.str), std::move(result));
+            }
+            catch (const std::exception& e)
+            {
+                lg2::error("Failed to decode JobRemoved: {ERROR}", "ERROR", e);
+            }
+        });
+    subscribeSystemdSignals(conn);
+}
+
+static boost::asio::awaitable<void> runUnitJob(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    const std::string& unitName, const std::string& actionMethod)
+{
+    auto deadline = getSystemdDeadline();
+    boost::system::error_code ec;
+    auto method = conn->new_method_call(sysdService, sysdObjPath, sysdMgrIntf,
+                                        actionMethod.c_str());
+    method.append(unitName, sysdReplaceMode);
+    auto reply = co_await callWithDeadline(conn, ec, method, deadline);
+    checkAndThrowSystemdFailure(ec,
+                                "Systemd operation failed, " + actionMethod);
+    sdbusplus::object_path jobPath;
+    reply.read(jobPath);
     // Query the job till it doesn't exist anymore.
     // this way we guarantee that queued job id is done.
     // this is needed to make sure dependency list on units are
     // properly handled.
     while (true)
     {
+        if (std::chrono::steady_clock::now() >= deadline)
+        {
+            // Don't leave a hung job behind to block the next apply
+            lg2::error("Systemd {ACTION} of {UNIT} timed out, cancelling {JOB}",
+                       "ACTION", actionMethod, "UNIT", unitName, "JOB",
+                       jobPath.str);
+            co_await cancelJob(conn, jobPath.str);
+            phosphor::logging::elog<
+                sdbusplus::xyz::openbmc_project::Common::Error::Timeout>();
+        }
         ec.clear();
-        conn->yield_method_call<>(yield, ec, sysdService, sysdObjPath,
-                                  sysdMgrIntf, sysdGetJobMethod,
-                                  getJobId(jobPath.str));
+        auto getJob = conn->new_method_call(sysdService, sysdObjPath,
+                                            sysdMgrIntf, sysdGetJobMethod);
+        getJob.append(getJobId(jobPath.str));
+        co_await callWithDeadline(conn, ec, getJob, deadline);
         if (ec)
         {
             if (ec.value() == boost::system::errc::no_such_file_or_directory)
             {
-                // Queued job is done, return now
-                return;
+                // Queued job is done. JobRemoved is sent before the job goes
+                // away, so its result is in by now.
+                auto result = jobResults.take(jobPath.str);
+                if (!result)
+                {
+                    lg2::error("No result for {JOB} of {UNIT}, assuming done",
+                               "JOB", jobPath.str, "UNIT", unitName);
+                    co_return;
+                }
+                checkJobResult(*result, "Systemd " + actionMethod + " of " +
+                                            unitName + " failed");
+                co_return;
+            }
+            if (ec.value() == boost::system::errc::timed_out)
+            {
+                // Deadline reached while waiting for the reply
+                continue;
             }
             lg2::error("Systemd operation failed for job query: {EC}", "EC",
                        ec.value());
@@ -87,47 +598,117 @@ void systemdUnitAction(const std::shared_ptr<sdbusplus::asio::connection>& conn,
         boost::asio::steady_timer sleepTimer(conn->get_io_context());
         sleepTimer.expires_after(std::chrono::milliseconds(20));
         ec.clear();
-        sleepTimer.async_wait(yield[ec]);
+        co_await sleepTimer.async_wait(
+            boost::asio::redirect_error(boost::asio::use_awaitable, ec));
         checkAndThrowInternalFailure(ec, "Systemd operation timer error");
     }
-    return;
 }
 
-void systemdUnitFilesStateChange(
+boost::asio::awaitable<void> systemdUnitAction(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    const std::string& unitName, const std::string& actionMethod)
+{
+    co_await timedSystemdCall(actionMethod, unitName,
+                              runUnitJob(conn, unitName, actionMethod));
+}
+
+boost::asio::awaitable<UnitTransitionTimes> getUnitTransitionTimes(
     const std::shared_ptr<sdbusplus::asio::connection>& conn,
-    boost::asio::yield_context yield, const std::vector<std::string>& unitFiles,
-    const std::string& unitState, bool maskedState, bool enabledState)
+    const std::string& unitName)
 {
+    UnitTransitionTimes times;
+    std::string path = systemdUnitObjectPath(unitName);
+    // One round trip for all four, this runs for every unit job of an apply
+    // cycle. The properties of other types are skipped when decoding.
     boost::system::error_code ec;
+    auto method = conn->new_method_call(sysdService, path.c_str(),
+                                        dBusPropIntf, dBusGetAllMethod);
+    method.append(sysdUnitIntf);
+    auto reply =
+        co_await callWithDeadline(conn, ec, method, getSystemdDeadline());
+    if (ec)
+    {
+        lg2::error("Failed to get the transition times of {UNIT}: {EC}",
+                   "UNIT", unitName, "EC", ec.value());
+        co_return times;
+    }
+    try
+    {
+        std::vector<std::pair<std::string, std::variant<uint64_t>>> properties;
+        reply.read(properties);
+        for (const auto& [property, value] : properties)
+        {
+            uint64_t timestamp = std::get<uint64_t>(value);
+            if (property == "ActiveExitTimestamp")
+            {
+                times.activeExit = timestamp;
+            }
+            else if (property == "InactiveEnterTimestamp")
+            {
+                times.inactiveEnter = timestamp;
+            }
+            else if (property == "InactiveExitTimestamp")
+            {
+                times.inactiveExit = timestamp;
+            }
+            else if (property == "ActiveEnterTimestamp")
+            {
+                times.activeEnter = timestamp;
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        lg2::error("Exception in decoding the transition times of {UNIT}: "
+                   "{ERROR}",
+                   "UNIT", unitName, "ERROR", e);
+    }
+    co_return times;
+}
 
-    if (unitState == stateMasked && !maskedState)
+std::vector<UnitFilesMethod> getUnitFilesStateChanges(
+    UnitFileState unitState, bool maskedState, bool enabledState)
+{
+    std::vector<UnitFilesMethod> methods;
+    if (unitState == UnitFileState::masked && !maskedState)
     {
-        conn->yield_method_call<>(yield, ec, sysdService, sysdObjPath,
-                                  sysdMgrIntf, "UnmaskUnitFiles", unitFiles,
-                                  false);
-        checkAndThrowInternalFailure(ec, "Systemd UnmaskUnitFiles() failed.");
+        methods.push_back(UnitFilesMethod::unmask);
     }
-    else if (unitState != stateMasked && maskedState)
+    else if (unitState != UnitFileState::masked && maskedState)
     {
-        conn->yield_method_call<>(yield, ec, sysdService, sysdObjPath,
-                                  sysdMgrIntf, "MaskUnitFiles", unitFiles,
-                                  false, false);
-        checkAndThrowInternalFailure(ec, "Systemd MaskUnitFiles() failed.");
+        methods.push_back(UnitFilesMethod::mask);
     }
-    ec.clear();
-    if (unitState != stateEnabled && enabledState)
+    if (unitState != UnitFileState::enabled && enabledState)
     {
-        conn->yield_method_call<>(yield, ec, sysdService, sysdObjPath,
-                                  sysdMgrIntf, "EnableUnitFiles", unitFiles,
-                                  false, false);
-        checkAndThrowInternalFailure(ec, "Systemd EnableUnitFiles() failed.");
+        methods.push_back(UnitFilesMethod::enable);
     }
-    else if (unitState != stateDisabled && !enabledState)
+    else if (unitState != UnitFileState::disabled && !enabledState)
     {
-        conn->yield_method_call<>(yield, ec, sysdService, sysdObjPath,
-                                  sysdMgrIntf, "DisableUnitFiles", unitFiles,
-                                  false);
-        checkAndThrowInternalFailure(ec, "Systemd DisableUnitFiles() failed.");
+        methods.push_back(UnitFilesMethod::disable);
+    }
+    return methods;
+}
+
+boost::asio::awaitable<void> systemdUnitFilesStateChange(
+    const std::shared_ptr<sdbusplus::asio::connection>& conn,
+    const std::vector<std::string>& unitFiles,
+    const std::vector<UnitFilesMethod>& methods)
+{
+    auto deadline = getSystemdDeadline();
+    std::string units = joinUnitNames(unitFiles);
+
+    for (auto method : methods)
+    {
+        const char* methodName = unitFilesMethodName(method);
+        // Unmask and Disable take (runtime), Mask and Enable take
+        // (runtime, force)
+        bool withForce = (method == UnitFilesMethod::mask ||
+                          method == UnitFilesMethod::enable);
+        co_await timedSystemdCall(
+            methodName, units,
+            withForce ? systemdManagerCall(conn, deadline, methodName,
+                                           unitFiles, false, false)
+                      : systemdManagerCall(conn, deadline, methodName,
+                                           unitFiles, false));
     }
-    return;
 }
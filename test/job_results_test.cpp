@@ -0,0 +1,63 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "utils.hpp"
+
+#include <gtest/gtest.h>
+
+using sdbusplus::xyz::openbmc_project::Common::Error::InternalFailure;
+using sdbusplus::xyz::openbmc_project::Common::Error::Timeout;
+
+TEST(JobResults, TakeReturnsRecordedResultOnce)
+{
+    JobResults results(4);
+    results.record("/org/freedesktop/systemd1/job/10", "failed");
+    results.record("/org/freedesktop/systemd1/job/11", "done");
+
+    EXPECT_EQ(results.take("/org/freedesktop/systemd1/job/10"), "failed");
+    EXPECT_EQ(results.take("/org/freedesktop/systemd1/job/10"), std::nullopt);
+    EXPECT_EQ(results.take("/org/freedesktop/systemd1/job/11"), "done");
+}
+
+TEST(JobResults, OldestResultsAreDropped)
+{
+    JobResults results(2);
+    results.record("/org/freedesktop/systemd1/job/1", "done");
+    results.record("/org/freedesktop/systemd1/job/2", "done");
+    results.record("/org/freedesktop/systemd1/job/3", "failed");
+
+    EXPECT_EQ(results.take("/org/freedesktop/systemd1/job/1"), std::nullopt);
+    EXPECT_EQ(results.take("/org/freedesktop/systemd1/job/3"), "failed");
+}
+
+TEST(JobResults, SuccessfulJobsPass)
+{
+    EXPECT_NO_THROW(checkJobResult("done", "StartUnit"));
+    EXPECT_NO_THROW(checkJobResult("skipped", "StartUnit"));
+}
+
+// A restart whose job fails (for instance when the new port can't be bound)
+// must fail its apply step, which is what rolls the object back
+TEST(JobResults, FailedRestartFailsTheStep)
+{
+    EXPECT_THROW(checkJobResult("failed", "RestartUnit"), InternalFailure);
+    EXPECT_THROW(checkJobResult("dependency", "RestartUnit"), InternalFailure);
+    EXPECT_THROW(checkJobResult("canceled", "RestartUnit"), InternalFailure);
+}
+
+TEST(JobResults, TimedOutJobReportsTimeout)
+{
+    EXPECT_THROW(checkJobResult("timeout", "RestartUnit"), Timeout);
+}
@@ -0,0 +1,191 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "utils.hpp"
+
+#include <sys/socket.h>
+#include <systemd/sd-bus.h>
+#include <unistd.h>
+
+#include <benchmark/benchmark.h>
+
+#include <stdexcept>
+#include <unordered_set>
+
+// Size of a ListUnits reply on a large system
+static constexpr size_t listedUnitCount = 2000;
+// Units in the reply that we manage
+static constexpr size_t managedUnitCount = 20;
+
+static void check(int r, const char* what)
+{
+    if (r < 0)
+    {
+        throw std::runtime_error(what);
+    }
+}
+
+// Messages need a started bus, which doesn't need a peer for building them
+class ListUnitsReply
+{
+  public:
+    ListUnitsReply()
+    {
+        int fds[2];
+        check(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds),
+              "socketpair");
+        peer = fds[1];
+        check(sd_bus_new(&bus), "sd_bus_new");
+        check(sd_bus_set_fd(bus, fds[0], fds[0]), "sd_bus_set_fd");
+        check(sd_bus_start(bus), "sd_bus_start");
+
+        sd_bus_message* m = nullptr;
+        check(sd_bus_message_new_signal(bus, &m, sysdObjPath, sysdMgrIntf,
+                                        "ListUnits"),
+              "sd_bus_message_new_signal");
+        msg = sdbusplus::message_t(m, std::false_type());
+        check(sd_bus_message_open_container(m, SD_BUS_TYPE_ARRAY,
+                                            "(ssssssouso)"),
+              "open array");
+        for (size_t i = 0; i < listedUnitCount; i++)
+        {
+            std::string name = "unit" + std::to_string(i) + ".service";
+            std::string path = systemdUnitObjectPath(name);
+            check(sd_bus_message_append(
+                      m, "(ssssssouso)", name.c_str(), "Some unit", "loaded",
+                      "active", "running", "", path.c_str(), 0u, "", "/"),
+                  "append unit");
+        }
+        check(sd_bus_message_close_container(m), "close array");
+        check(sd_bus_message_seal(m, 1, 0), "sd_bus_message_seal");
+    }
+
+    ~ListUnitsReply()
+    {
+        msg = sdbusplus::message_t();
+        sd_bus_unref(bus);
+        close(peer);
+    }
+
+    ListUnitsReply(const ListUnitsReply&) = delete;
+    ListUnitsReply& operator=(const ListUnitsReply&) = delete;
+
+    sdbusplus::message_t& rewound()
+    {
+        check(sd_bus_message_rewind(msg.get(), 1), "sd_bus_message_rewind");
+        return msg;
+    }
+
+  private:
+    sd_bus* bus = nullptr;
+    int peer = -1;
+    sdbusplus::message_t msg;
+};
+
+struct StringHash
+{
+    using is_transparent = void;
+
+    size_t operator()(std::string_view str) const
+    {
+        return std::hash<std::string_view>{}(str);
+    }
+};
+using UnitNames =
+    std::unordered_set<std::string, StringHash, std::equal_to<>>;
+
+static UnitNames managedUnits()
+{
+    UnitNames names;
+    for (size_t i = 0; i < managedUnitCount; i++)
+    {
+        names.insert("unit" + std::to_string(i * 100) + ".service");
+    }
+    return names;
+}
+
+// Filtering while reading, copying out the matches only
+static void listUnitsInPlace(benchmark::State& state)
+{
+    ListUnitsReply reply;
+    auto managed = managedUnits();
+    for (auto _ : state)
+    {
+        std::vector<std::pair<std::string, std::string>> matches;
+        forEachListedUnit(reply.rewound(), [&](const ListedUnit& unit) {
+            if (managed.contains(unit.name))
+            {
+                matches.emplace_back(unit.name, unit.objectPath);
+            }
+        });
+        benchmark::DoNotOptimize(matches.data());
+    }
+    state.SetItemsProcessed(state.iterations() * listedUnitCount);
+}
+BENCHMARK(listUnitsInPlace);
+
+// The full copy of every entry that decoding into a vector of tuples makes,
+// before filtering
+struct CopiedUnit
+{
+    std::string name;
+    std::string description;
+    std::string loadState;
+    std::string activeState;
+    std::string subState;
+    std::string followedUnit;
+    std::string objectPath;
+    uint32_t queuedJobType;
+    std::string jobType;
+    std::string jobObject;
+};
+
+static void listUnitsCopyAll(benchmark::State& state)
+{
+    ListUnitsReply reply;
+    auto managed = managedUnits();
+    for (auto _ : state)
+    {
+        auto& msg = reply.rewound();
+        std::vector<CopiedUnit> units;
+        check(sd_bus_message_enter_container(msg.get(), SD_BUS_TYPE_ARRAY,
+                                             "(ssssssouso)"),
+              "enter array");
+        const char* fields[9] = {};
+        uint32_t queuedJobType = 0;
+        while (sd_bus_message_read(msg.get(), "(ssssssouso)", &fields[0],
+                                   &fields[1], &fields[2], &fields[3],
+                                   &fields[4], &fields[5], &fields[6],
+                                   &queuedJobType, &fields[7], &fields[8]) > 0)
+        {
+            units.push_back({fields[0], fields[1], fields[2], fields[3],
+                             fields[4], fields[5], fields[6], queuedJobType,
+                             fields[7], fields[8]});
+        }
+        std::vector<std::pair<std::string, std::string>> matches;
+        for (auto& unit : units)
+        {
+            if (managed.contains(unit.name))
+            {
+                matches.emplace_back(unit.name, unit.objectPath);
+            }
+        }
+        benchmark::DoNotOptimize(matches.data());
+    }
+    state.SetItemsProcessed(state.iterations() * listedUnitCount);
+}
+BENCHMARK(listUnitsCopyAll);
+
+BENCHMARK_MAIN();
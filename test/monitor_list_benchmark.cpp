@@ -0,0 +1,111 @@
+/*
+// Copyright (c) 2018 Intel Corporation
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+*/
+#include "monitor_list.hpp"
+
+#include <benchmark/benchmark.h>
+
+using phosphor::service::MonitorListMap;
+using phosphor::service::reconcileMonitorList;
+
+static MonitorListMap makeMonitorList(size_t count)
+{
+    MonitorListMap list;
+    for (size_t i = 0; i < count; i++)
+    {
+        std::string instance = "tty" + std::to_string(i);
+        list.emplace("obmc-console@" + instance,
+                     std::make_tuple("obmc-console", instance,
+                                     "/org/freedesktop/systemd1/unit/"
+                                     "obmc_2dconsole_40" +
+                                         instance + "_2eservice",
+                                     ""));
+    }
+    return list;
+}
+
+// Startup with a saved list already in line with the listed units, the
+// common case, where nothing is rewritten
+static void reconcileUnchanged(benchmark::State& state)
+{
+    auto count = static_cast<size_t>(state.range(0));
+    MonitorListMap listed = makeMonitorList(count);
+    MonitorListMap saved = listed;
+    for (auto _ : state)
+    {
+        auto changes = reconcileMonitorList(listed, saved);
+        benchmark::DoNotOptimize(changes);
+    }
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(reconcileUnchanged)->Arg(200)->Arg(2000)->Complexity();
+
+// Every entry added to an empty saved list, as on the first boot
+static void reconcileAdded(benchmark::State& state)
+{
+    auto count = static_cast<size_t>(state.range(0));
+    MonitorListMap listed = makeMonitorList(count);
+    for (auto _ : state)
+    {
+        MonitorListMap saved;
+        auto changes = reconcileMonitorList(listed, saved);
+        benchmark::DoNotOptimize(changes);
+    }
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(reconcileAdded)->Arg(200)->Arg(2000)->Complexity();
+
+// Every saved entry with a changed object path
+static void reconcileChanged(benchmark::State& state)
+{
+    auto count = static_cast<size_t>(state.range(0));
+    MonitorListMap listed = makeMonitorList(count);
+    MonitorListMap stale = listed;
+    for (auto& [key, value] : stale)
+    {
+        std::get<2>(value) += "_old";
+    }
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        MonitorListMap saved = stale;
+        state.ResumeTiming();
+        auto changes = reconcileMonitorList(listed, saved);
+        benchmark::DoNotOptimize(changes);
+    }
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(reconcileChanged)->Arg(200)->Arg(2000)->Complexity();
+
+// Every saved entry dropped, as after the console instances are removed.
+// The instances are neither listed nor installed on the build host.
+static void reconcileRemoved(benchmark::State& state)
+{
+    auto count = static_cast<size_t>(state.range(0));
+    MonitorListMap listed;
+    MonitorListMap removed = makeMonitorList(count);
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        MonitorListMap saved = removed;
+        state.ResumeTiming();
+        auto changes = reconcileMonitorList(listed, saved);
+        benchmark::DoNotOptimize(changes);
+    }
+    state.SetComplexityN(state.range(0));
+}
+BENCHMARK(reconcileRemoved)->Arg(200)->Arg(2000)->Complexity();
+
+BENCHMARK_MAIN();